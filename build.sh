@@ -3,6 +3,22 @@
 # I recommend you install MSYS2 <http://www.msys2.org>, run the mingw32.exe shell,
 # in that shell run `pacman -S mingw-w64-i686-toolchain` and then this script.
 # I did this on Windows 11; the resulting .exe worked on 32-bit Windows NT.
+# `build.sh production` builds an optimized comProxy.exe without TRACE logging,
+# which uses SSE2 (so it needs a Pentium 4 or later).
+# `build.sh test` builds and runs test/comProxyTest (which doesn't need a COM port),
+# on Windows or Linux. On Linux, test/linux stands in for Windows.
 
 cd `dirname "$0"` || exit $?
+if [ "$1" = "test" ]; then
+    if [ "`uname`" = "Linux" ]; then
+        g++ -Itest/linux test/comProxyTest.cpp test/linux/Windows.cpp -o test/comProxyTest -lpthread || exit $?
+        exec test/comProxyTest
+    fi
+    g++ -static test/comProxyTest.cpp -o test/comProxyTest.exe -lWs2_32 || exit $?
+    exec test/comProxyTest.exe
+fi
+g++ -static -O2 comProxyTraceDecode.cpp -o comProxyTraceDecode.exe || exit $?
+if [ "$1" = "production" ]; then
+    exec g++ -static -O2 -msse2 -DLOG_MAX_LEVEL=2 comProxy.cpp -o comProxy.exe -lWs2_32
+fi
 exec g++ -static comProxy.cpp -o comProxy.exe -lWs2_32
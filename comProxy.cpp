@@ -3,6 +3,9 @@
     stdout. It copies bytes in both directions concurrently. It logs progress
     and errors to stderr. It exits with a non-zero exit code when some errors
     occur.
+
+    Alternatively, it serves several COM ports, each through its own named
+    pipe (see the engine, below).
 */
 /* It's tricky to implement this. There's some guidance in "Serial Communications"
    https://learn.microsoft.com/en-us/previous-versions/ff802693(v=msdn.10)?redirectedfrom=MSDN
@@ -31,31 +34,26 @@
    I tried setting these events to auto-reset, but that seems to be too
    aggressive. It appears WaitForMultipleObjects resets *all* the auto-reset
    objects, but WAIT_OBJECT_0 + N can only indicate one of them. So you can
-   miss an event, if two of them occur concurrently.
+   miss an event, if two of them occur concurrently. So this code doesn't
+   wait for those events; it uses an I/O completion port instead.
 
    Overlapped input from stdin and overlapped output to stdout don't work.
    You can wait for stdin but not stdout. stdin is signaled when there isn't
    any input available. Reading from stdin blocks until some input arrives.
 
    To handle stdin and stdout, this code starts two threads, one to read from
-   stdin and another to write to stdout. They coordinate with the main thread
+   stdin and another to write to stdout. They coordinate with the engine
    via RingBuffer objects. The reader and writer threads block on I/O and
-   Events. The main thread calls buffer methods after being alerted via Events.
+   Events. They alert the engine by posting completion packets.
  */
 #include <Windows.h>
 #include <fcntl.h>
 #include <stdio.h>
-
-static HANDLE comHandle;
-// I/O to and from comHandle is asynchronous:
-static OVERLAPPED comEventOverlapped = {0};
-static OVERLAPPED comRxOverlapped = {0};
-static OVERLAPPED comTxOverlapped = {0};
-static DWORD comEventMask = 0;
-static DWORD comEventError = ERROR_SUCCESS; // from WaitCommEvent(comHandle)
-static DWORD comRxError = ERROR_SUCCESS; // from ReadFile(comHandle)
-static DWORD comTxError = ERROR_SUCCESS; // from WriteFile(comHandle)
-static BOOL comDone = FALSE;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "comProxyShm.h"
+#include "comProxyTrace.h"
 
 static const int stdinNumber = _fileno(stdin);
 static const int stdoutNumber = _fileno(stdout);
@@ -65,51 +63,528 @@ static BOOL stdoutDone = FALSE;
 static const int INFO = 1;
 static const int DEBUG = 2;
 static const int TRACE = 3;
-static const int MAX_MESSAGE = 300;
+static const int DUMP_SPACE = 1024; // for data formatted by dump
+static const int MAX_MESSAGE = DUMP_SPACE + 300;
+
+/** Return the time in microseconds, since some arbitrary moment. */
+static LONGLONG microseconds() {
+    static LONGLONG frequency = 0;
+    LARGE_INTEGER now;
+    if (frequency == 0) {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        frequency = f.QuadPart;
+    }
+    QueryPerformanceCounter(&now);
+    return (now.QuadPart / frequency) * 1000000
+        + ((now.QuadPart % frequency) * 1000000) / frequency;
+}
+
+/* Log messages are stamped with microseconds(), which is monotonic and
+   much more precise than the system time of day (which may advance in
+   steps of 15 milliseconds). startClock records the time of day that
+   corresponds to some microseconds(), and stampTime uses that to convert.
+ */
+static LONGLONG clockStart = 0; // microseconds()
+static ULONGLONG clockStartWall = 0; // the time of day at clockStart, as a FILETIME
+
+static void startClock() {
+    FILETIME wall;
+    GetSystemTimeAsFileTime(&wall);
+    clockStart = microseconds();
+    ULARGE_INTEGER w;
+    w.LowPart = wall.dwLowDateTime;
+    w.HighPart = wall.dwHighDateTime;
+    clockStartWall = w.QuadPart;
+}
 
-static int logLevel = TRACE;
+static int volatile logLevel = TRACE; // at most LOG_MAX_LEVEL matters
 static FILE* logFile = NULL;
-static int stampTime(char* message) {
-    SYSTEMTIME st;
-    GetSystemTime(&st);
-    return snprintf(message, MAX_MESSAGE,
-                    "[%04d-%02d-%02dT%02d:%02d:%02d.%03dZ] ",
-                    st.wYear, st.wMonth, st.wDay,
-                    st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
-}
-static void logInfo(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    char message[MAX_MESSAGE + 1];
-    if (logLevel >= INFO && logFile != NULL) {
-        int start = stampTime(message);
-        vsnprintf(message + start, MAX_MESSAGE - start, format, args);
-        fprintf(logFile, "%s\n", message);
+static char* volatile logFileNext = NULL; // the logger thread should switch to this file
+static CRITICAL_SECTION logLock; // held while writing to logFile, or changing it
+
+/* Logging is asynchronous: a thread that logs a message copies the format
+   and its arguments into a LogRecord in logQueue, and the logger thread
+   formats the record and writes it to logFile. So I/O threads don't wait
+   for a slow log file (or console). Many threads may add records without
+   locking: each claims a slot by incrementing logTail, and marks it ready
+   by setting its sequence number. If the queue is full the message is
+   counted in logDropped, not waited for. Until the logger thread starts
+   (and after it stops), messages are written synchronously. Either way,
+   they're written with logLock held, so other threads that log while the
+   logger thread isn't running don't interleave output (or use logFile
+   after main closes it).
+ */
+static const int LOG_MAX_ARGS = 12;
+static const int LOG_STRING_SPACE = DUMP_SPACE + 256; // for copies of %s arguments
+static const LONG LOG_QUEUE_SIZE = 1024; // a power of 2
+union LogArg {
+    LONGLONG i;
+    double f;
+    const void* p;
+};
+struct LogRecord {
+    LONG volatile sequence; // == position when empty, position + 1 when ready
+    LONGLONG time; // microseconds()
+    const char* format;
+    LogArg args[LOG_MAX_ARGS];
+    char strings[LOG_STRING_SPACE];
+};
+static LogRecord* logQueue = NULL;
+static LONG volatile logTail = 0; // the next position to claim
+static LONG logHead = 0; // the next position to write; used only by the logger thread
+static LONG volatile logDropped = 0;
+static LONG volatile loggerWaiting = FALSE;
+static HANDLE loggerBell = NULL; // rung after adding a record while loggerWaiting
+static HANDLE loggerThread = NULL;
+static BOOL volatile loggerStopping = FALSE;
+
+/** Parse the conversion specification at format (following '%'), and set
+    *type to the type of its argument: 'i', 'I' (64 bits), 'f', 's', 'p',
+    or 0 if it has none. Return the length of the specification.
+ */
+static int logConversion(const char* format, char* type) {
+    int c = 0;
+    BOOL isLong = FALSE;
+    while (format[c] != 0 && strchr("-+ #0123456789.", format[c]) != NULL) ++c;
+    while (format[c] == 'l' || format[c] == 'h' || format[c] == 'z' || format[c] == 'I'
+           || (format[c] == '6' && format[c + 1] == '4')) {
+        if (format[c] == 'l' && format[c + 1] == 'l') isLong = TRUE;
+        if (format[c] == '6') {
+            isLong = TRUE;
+            ++c;
+        }
+        ++c;
     }
-    va_end(args);
+    switch (format[c]) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        *type = isLong ? 'I' : 'i';
+        break;
+    case 'e': case 'E': case 'f': case 'g': case 'G':
+        *type = 'f';
+        break;
+    case 's':
+        *type = 's';
+        break;
+    case 'p':
+        *type = 'p';
+        break;
+    default: // including '%'
+        *type = 0;
+    }
+    return (format[c] == 0) ? c : c + 1;
 }
-static void logDebug(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
+
+/** Format a record, like vsnprintf. */
+static int logFormat(char* message, int size, LogRecord* record) {
+    int length = 0;
+    int a = 0;
+    const char* f = record->format;
+    while (*f != 0 && length < size - 1) {
+        if (*f != '%') {
+            message[length++] = *f++;
+            continue;
+        }
+        char spec[16];
+        char type;
+        int specLength = 1 + logConversion(f + 1, &type);
+        if (specLength >= (int) sizeof(spec) || (type != 0 && a >= LOG_MAX_ARGS)) break;
+        memcpy(spec, f, specLength);
+        spec[specLength] = 0;
+        f += specLength;
+        int n;
+        switch (type) {
+        case 'i': n = snprintf(message + length, size - length, spec, (int) record->args[a++].i); break;
+        case 'I': n = snprintf(message + length, size - length, spec, record->args[a++].i); break;
+        case 'f': n = snprintf(message + length, size - length, spec, record->args[a++].f); break;
+        case 's': n = snprintf(message + length, size - length, spec,
+                               record->strings + record->args[a++].i); break;
+        case 'p': n = snprintf(message + length, size - length, spec, record->args[a++].p); break;
+        default: n = snprintf(message + length, size - length, "%s", (spec[1] == '%') ? "%" : spec);
+        }
+        if (n < 0) break;
+        length += n;
+        if (length >= size) length = size - 1;
+    }
+    message[length] = 0;
+    return length;
+}
+
+/** Format time (from microseconds()) as the time of day, in message.
+    Return the length of the result. The date and time to the second are
+    formatted at most once per second. The caller must hold logLock.
+ */
+static int stampTime(char* message, LONGLONG time) {
+    static LONGLONG second = -1; // since clockStartWall, formatted in secondStamp
+    static char secondStamp[32];
+    static int secondLength = 0;
+    if (clockStart == 0) startClock();
+    LONGLONG since = (clockStartWall / 10) + (time - clockStart); // microseconds
+    if (since / 1000000 != second) {
+        second = since / 1000000;
+        ULARGE_INTEGER w;
+        w.QuadPart = second * 10000000;
+        FILETIME wall;
+        wall.dwLowDateTime = w.LowPart;
+        wall.dwHighDateTime = w.HighPart;
+        SYSTEMTIME st;
+        FileTimeToSystemTime(&wall, &st);
+        secondLength = snprintf(secondStamp, sizeof(secondStamp),
+                                "[%04d-%02d-%02dT%02d:%02d:%02d.",
+                                st.wYear, st.wMonth, st.wDay,
+                                st.wHour, st.wMinute, st.wSecond);
+    }
+    memcpy(message, secondStamp, secondLength);
+    int fraction = (int) (since % 1000000);
+    for (int d = 5; d >= 0; --d) {
+        message[secondLength + d] = '0' + (fraction % 10);
+        fraction /= 10;
+    }
+    memcpy(message + secondLength + 6, "Z] ", 4);
+    return secondLength + 9;
+}
+
+static void logWrite(LogRecord* record) {
     char message[MAX_MESSAGE + 1];
-    if (logLevel >= DEBUG && logFile != NULL) {
-        int start = stampTime(message);
-        vsnprintf(message + start, MAX_MESSAGE - start, format, args);
-        fprintf(logFile, "%s\n", message);
+    int start = stampTime(message, record->time);
+    logFormat(message + start, MAX_MESSAGE - start, record);
+    fprintf(logFile, "%s\n", message);
+}
+
+/* The flight recorder: trace (below) always records I/O events in
+   flightRing, which holds the most recent FLIGHT_RING_SIZE of them. That
+   costs a few memory writes per event. When something goes wrong,
+   flightDump writes the ring to the log, which shows what led up to it
+   even when TRACE messages aren't logged.
+ */
+static const DWORD FLIGHT_RING_SIZE = 4096; // a power of 2
+static ComProxyTraceRecord flightRing[FLIGHT_RING_SIZE];
+static LONG volatile flightNext = 0; // the position of the next record, modulo 2^32
+static const char* flightPortNames[COM_PROXY_TRACE_MAX_PORTS];
+static LONG volatile flightDumpWanted = FALSE;
+static const char* volatile flightDumpReason = NULL;
+
+/** Fill in the record at position in a trace ring. */
+static void traceRecord(ComProxyTraceRecord* record, DWORD position, LONGLONG time,
+                        WORD port, WORD event, DWORD a, DWORD b, DWORD c) {
+    record->sequence = 0; // incomplete
+    MemoryBarrier();
+    record->time = time;
+    record->event = event;
+    record->port = port;
+    record->a = a;
+    record->b = b;
+    record->c = c;
+    MemoryBarrier();
+    record->sequence = position + 1;
+}
+
+/** Write the flight recorder to logFile. */
+static void flightWrite(const char* reason) {
+    EnterCriticalSection(&logLock);
+    if (logFile == NULL) {
+        LeaveCriticalSection(&logLock);
+        return;
+    }
+    // Positions wrap around, so visit the whole ring, oldest first; records
+    // that were never written have no sequence, and are skipped below.
+    DWORD next = (DWORD) flightNext;
+    int events = 0;
+    fprintf(logFile, "(flight recorder: %s)\n", reason);
+    for (DWORD position = next - FLIGHT_RING_SIZE; position != next; ++position) {
+        ComProxyTraceRecord* from = &flightRing[position & (FLIGHT_RING_SIZE - 1)];
+        DWORD sequence = from->sequence;
+        MemoryBarrier();
+        ComProxyTraceRecord record = *from;
+        MemoryBarrier();
+        // Skip records that are incomplete, or were replaced while being copied.
+        if (sequence == 0 || sequence != position + 1 || from->sequence != sequence) continue;
+        ++events;
+        char stamp[40];
+        stampTime(stamp, record.time);
+        fprintf(logFile, "%s%s %s %lu %lu %lu\n", stamp,
+                (record.port < COM_PROXY_TRACE_MAX_PORTS && flightPortNames[record.port] != NULL)
+                ? flightPortNames[record.port] : "?",
+                comProxyTraceEventName(record.event),
+                (unsigned long) record.a, (unsigned long) record.b, (unsigned long) record.c);
+    }
+    fprintf(logFile, "(end of flight recorder; %d events)\n", events);
+    fflush(logFile);
+    LeaveCriticalSection(&logLock);
+}
+
+/** Copy the format and its arguments into record. */
+static void logCapture(LogRecord* record, const char* format, va_list args) {
+    int a = 0;
+    int strings = 0;
+    record->format = format;
+    for (const char* f = format; *f != 0; ++f) {
+        if (*f != '%') continue;
+        char type;
+        f += logConversion(f + 1, &type);
+        if (type == 0) continue;
+        if (a >= LOG_MAX_ARGS) break;
+        switch (type) {
+        case 'i': record->args[a].i = va_arg(args, int); break;
+        case 'I': record->args[a].i = va_arg(args, LONGLONG); break;
+        case 'f': record->args[a].f = va_arg(args, double); break;
+        case 'p': record->args[a].p = va_arg(args, void*); break;
+        case 's': {
+            // The string may change (or be freed) before the record is written.
+            const char* s = va_arg(args, const char*);
+            if (s == NULL) s = "(null)";
+            int length = strlen(s);
+            if (length > LOG_STRING_SPACE - 1 - strings) length = LOG_STRING_SPACE - 1 - strings;
+            if (length < 0) length = 0;
+            memcpy(record->strings + strings, s, length);
+            record->strings[strings + length] = 0;
+            record->args[a].i = strings;
+            strings += length + ((strings + length < LOG_STRING_SPACE - 1) ? 1 : 0);
+            break;
+        }
+        }
+        ++a;
+    }
+}
+
+static void logMessage(const char* format, va_list args) {
+    if (logFile == NULL) return;
+    if (loggerThread == NULL) {
+        LogRecord record;
+        record.time = microseconds();
+        logCapture(&record, format, args);
+        EnterCriticalSection(&logLock);
+        if (logFile != NULL) logWrite(&record);
+        LeaveCriticalSection(&logLock);
+        return;
+    }
+    LogRecord* record;
+    LONG position;
+    while (TRUE) {
+        position = logTail;
+        record = &logQueue[position & (LOG_QUEUE_SIZE - 1)];
+        LONG sequence = record->sequence;
+        if (sequence == position) {
+            if (InterlockedCompareExchange(&logTail, position + 1, position) == position) break;
+        } else if (sequence - position < 0) {
+            InterlockedIncrement(&logDropped); // The queue is full.
+            return;
+        }
+        // Another thread claimed this position. Try the next one.
+    }
+    record->time = microseconds();
+    logCapture(record, format, args);
+    InterlockedExchange(&record->sequence, position + 1);
+    if (InterlockedExchange(&loggerWaiting, FALSE)) SetEvent(loggerBell);
+}
+
+/** Write all the ready records. Return FALSE if there were none. */
+static BOOL logDrain() {
+    BOOL drained = FALSE;
+    EnterCriticalSection(&logLock);
+    while (TRUE) {
+        LogRecord* record = &logQueue[logHead & (LOG_QUEUE_SIZE - 1)];
+        if (record->sequence != logHead + 1) break;
+        if (logFile != NULL) logWrite(record);
+        InterlockedExchange(&record->sequence, logHead + LOG_QUEUE_SIZE);
+        ++logHead;
+        drained = TRUE;
+    }
+    LONG dropped = InterlockedExchange(&logDropped, 0);
+    if (dropped > 0 && logFile != NULL) {
+        fprintf(logFile, "(dropped %d log messages)\n", (int) dropped);
+        drained = TRUE;
+    }
+    if (drained && logFile != NULL) fflush(logFile);
+    LeaveCriticalSection(&logLock);
+    return drained;
+}
+
+/** Switch to logFileNext, if it's set. Only the logger thread calls this. */
+static void logSwitch() {
+    char* fileName = (char*) InterlockedExchangePointer((void* volatile*) &logFileNext, NULL);
+    if (fileName == NULL) return;
+    EnterCriticalSection(&logLock);
+    if (logFile == NULL) {
+        LeaveCriticalSection(&logLock);
+        free(fileName);
+        return;
+    }
+    FILE* file = fopen(fileName, "a");
+    if (file == NULL) {
+        fprintf(logFile, "(fopen(%s) failed)\n", fileName);
+    } else {
+        fprintf(logFile, "(continued in %s)\n", fileName);
+        if (logFile != stderr) fclose(logFile);
+        logFile = file;
+    }
+    LeaveCriticalSection(&logLock);
+    free(fileName);
+}
+
+static DWORD WINAPI logger(LPVOID parameter) {
+    while (TRUE) {
+        logSwitch();
+        if (logDrain()) continue;
+        if (InterlockedExchange(&flightDumpWanted, FALSE)) {
+            flightWrite(flightDumpReason);
+            continue;
+        }
+        if (loggerStopping) return 0;
+        InterlockedExchange(&loggerWaiting, TRUE);
+        if (logDrain()) continue; // A record was added before loggerWaiting was set.
+        WaitForSingleObject(loggerBell, 100);
+    }
+}
+
+/** Write the flight recorder to the log, soon. reason must be a constant string. */
+static void flightDump(const char* reason) {
+    if (logFile == NULL) return;
+    if (loggerThread == NULL) {
+        flightWrite(reason);
+    } else {
+        flightDumpReason = reason;
+        InterlockedExchange(&flightDumpWanted, TRUE);
+        SetEvent(loggerBell);
     }
-    va_end(args);
 }
-static void logTrace(const char* format, ...) {
+
+/** Write the queued log messages, and then log synchronously. */
+static void stopLogger() {
+    if (loggerThread == NULL) return;
+    loggerStopping = TRUE;
+    SetEvent(loggerBell);
+    WaitForSingleObject(loggerThread, INFINITE);
+    CloseHandle(loggerThread);
+    loggerThread = NULL;
+    logDrain(); // records added while the logger thread was stopping
+}
+
+/** Stop logging, and close logFile. Other threads may still try to log. */
+static void closeLog() {
+    stopLogger();
+    EnterCriticalSection(&logLock);
+    FILE* file = logFile;
+    logFile = NULL;
+    LeaveCriticalSection(&logLock);
+    if (file != NULL) fclose(file);
+}
+
+/** Start writing log messages asynchronously. */
+static void startLogger() {
+    logQueue = new LogRecord[LOG_QUEUE_SIZE];
+    for (LONG r = 0; r < LOG_QUEUE_SIZE; ++r) logQueue[r].sequence = r;
+    loggerBell = CreateEvent(NULL, FALSE, FALSE, NULL);
+    loggerThread = CreateThread(NULL, 0, logger, NULL, 0, NULL);
+    atexit(stopLogger); // in case main returns early
+}
+
+static void logPrint(const char* format, ...) {
     va_list args;
     va_start(args, format);
-    char message[MAX_MESSAGE + 1];
-    if (logLevel >= TRACE && logFile != NULL) {
-        int start = stampTime(message);
-        vsnprintf(message + start, MAX_MESSAGE - start, format, args);
-        fprintf(logFile, "%s\n", message);
-    }
+    logMessage(format, args);
     va_end(args);
 }
+
+/* The log level and file can be changed while comProxy is running, by a
+   broker request (see brokerReadDone) or by Ctrl+Break. So a port can be
+   traced while it misbehaves, without restarting comProxy.
+ */
+static const char* logLevelNames[] = {"none", "info", "debug", "trace"};
+
+/** Return the level named name (or its number), or -1 if there's none. */
+static int parseLogLevel(const char* name) {
+    if (name[0] >= '0' && name[0] <= '9' && name[1] == 0) {
+        int level = name[0] - '0';
+        return (level <= TRACE) ? level : -1;
+    }
+    for (int level = 0; level <= TRACE; ++level) {
+        if (_stricmp(name, logLevelNames[level]) == 0) return level;
+    }
+    return -1;
+}
+
+/** Change logLevel, and log that (regardless of either level). */
+static void setLogLevel(int level) {
+    logPrint("log level %s (was %s)", logLevelNames[level], logLevelNames[logLevel]);
+    logLevel = level;
+}
+
+/* The directory of the log file named on the command line (including the
+   trailing separator, or "" for the current directory), or NULL when logging
+   to stderr. setLogFile only creates files in this directory.
+ */
+static char* logDirectory = NULL;
+
+/** Return TRUE if fileName is a plain file name: not empty, no directory,
+    drive or stream, no "..", and not a device such as NUL or COM1.
+ */
+static BOOL isPlainFileName(const char* fileName) {
+    if (*fileName == 0 || strstr(fileName, "..") != NULL) return FALSE;
+    for (const char* c = fileName; *c != 0; ++c) {
+        if ((unsigned char) *c < ' ' || strchr("\\/:*?\"<>|", *c) != NULL) return FALSE;
+    }
+    static const char* devices[] = {"CON", "PRN", "AUX", "NUL", "COM", "LPT"};
+    size_t stem = strcspn(fileName, ". ");
+    for (int d = 0; d < (int) (sizeof(devices) / sizeof(devices[0])); ++d) {
+        if (_strnicmp(fileName, devices[d], 3) != 0) continue;
+        if (stem == 3) return FALSE;
+        if (stem == 4 && d >= 4 && fileName[3] >= '0' && fileName[3] <= '9') return FALSE; // COM1, LPT1...
+    }
+    return TRUE;
+}
+
+/** Ask the logger thread to continue logging in the file named fileName,
+    in logDirectory. Return FALSE (and do nothing) if fileName isn't a plain
+    file name, or comProxy isn't logging to a file.
+ */
+static BOOL setLogFile(const char* fileName) {
+    if (logDirectory == NULL || !isPlainFileName(fileName)) return FALSE;
+    size_t length = strlen(logDirectory) + strlen(fileName);
+    if (length >= MAX_PATH) return FALSE;
+    char* path = (char*) malloc(length + 1);
+    if (path == NULL) return FALSE;
+    strcpy(path, logDirectory);
+    strcat(path, fileName);
+    char* was = (char*) InterlockedExchangePointer((void* volatile*) &logFileNext, path);
+    if (was != NULL) free(was);
+    SetEvent(loggerBell);
+    return TRUE;
+}
+
+/** Ctrl+Break (or GenerateConsoleCtrlEvent) increases the log level,
+    from INFO to DEBUG to TRACE and then back to INFO.
+ */
+static BOOL WINAPI consoleControl(DWORD event) {
+    if (event != CTRL_BREAK_EVENT) return FALSE; // the default handler
+    int level = logLevel + 1;
+    setLogLevel((level > TRACE) ? INFO : level);
+    return TRUE;
+}
+
+/* logInfo, logDebug and logTrace log a message if logLevel is high enough.
+   Otherwise they don't evaluate their arguments. Levels above LOG_MAX_LEVEL
+   are compiled out entirely; for example build with -DLOG_MAX_LEVEL=2 to
+   omit TRACE logging.
+ */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 3
+#endif
+#if LOG_MAX_LEVEL >= 1
+#define logInfo(...) ((logLevel >= INFO) ? logPrint(__VA_ARGS__) : (void) 0)
+#else
+#define logInfo(...) ((void) 0)
+#endif
+#if LOG_MAX_LEVEL >= 2
+#define logDebug(...) ((logLevel >= DEBUG) ? logPrint(__VA_ARGS__) : (void) 0)
+#else
+#define logDebug(...) ((void) 0)
+#endif
+#if LOG_MAX_LEVEL >= 3
+#define logTrace(...) ((logLevel >= TRACE) ? logPrint(__VA_ARGS__) : (void) 0)
+#else
+#define logTrace(...) ((void) 0)
+#endif
 static LPSTR errorMessage(DWORD errorCode) {
     LPSTR message = NULL;
     FormatMessage
@@ -164,33 +639,262 @@ static void logIOResult(const char* from, DWORD err, DWORD count) {
     }
 }
 
-static char asStringBuffer[256];
-static const char* asString(const BYTE* from, DWORD length) {
-    if (length <= 0 || logLevel < DEBUG) return "";
-    DWORD end = length;
-    if (end >= sizeof(asStringBuffer)) {
-        end = sizeof(asStringBuffer) - 1;
+/* Data are logged (at DEBUG level) by dump, in one of these forms:
+   DUMP_PRINTABLE replaces control characters and non-ASCII bytes with '.';
+   DUMP_HEX shows two hex digits per byte; DUMP_C escapes them like a C
+   string literal. At most dumpMax bytes are shown, followed by "..." if
+   there are more (or they don't fit in DUMP_SPACE).
+   The result is in a struct on the caller's stack, so threads may call
+   dump concurrently: logDebug("%s", dump(data, length).text).
+ */
+enum DumpMode {DUMP_PRINTABLE, DUMP_HEX, DUMP_C};
+static DumpMode dumpMode = DUMP_PRINTABLE;
+static DWORD dumpMax = 256;
+struct Dump {
+    char text[DUMP_SPACE];
+};
+static const char hexDigits[] = "0123456789ABCDEF";
+
+/** Copy length bytes from from to to, replacing unprintable bytes with '.'. */
+static void dumpPrintable(char* to, const BYTE* from, DWORD length) {
+    DWORD c = 0;
+#ifdef __SSE2__
+    // As signed bytes, the printable ones are > 0x1F and != 0x7F.
+    const __m128i space = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i dot = _mm_set1_epi8('.');
+    for (; c + 16 <= length; c += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i*) (from + c));
+        __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(b, del), _mm_cmpgt_epi8(b, space));
+        _mm_storeu_si128((__m128i*) (to + c),
+                         _mm_or_si128(_mm_and_si128(ok, b), _mm_andnot_si128(ok, dot)));
+    }
+#endif
+    for (; c < length; ++c) {
+        BYTE b = from[c];
+        to[c] = (b >= ' ' && b < 0x7F) ? b : '.';
+    }
+}
+
+/** Write two hex digits for each of length bytes from from into to. */
+static void dumpHex(char* to, const BYTE* from, DWORD length) {
+    DWORD c = 0;
+#ifdef __SSE2__
+    // Translate each nibble n to '0' + n, plus 7 if n > 9 (to make 'A'..'F').
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letters = _mm_set1_epi8('A' - '0' - 10);
+    for (; c + 16 <= length; c += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i*) (from + c));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(b, 4), nibble);
+        __m128i low = _mm_and_si128(b, nibble);
+        high = _mm_add_epi8(_mm_add_epi8(high, zero), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letters));
+        low = _mm_add_epi8(_mm_add_epi8(low, zero), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letters));
+        _mm_storeu_si128((__m128i*) (to + 2 * c), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i*) (to + 2 * c + 16), _mm_unpackhi_epi8(high, low));
+    }
+#endif
+    for (; c < length; ++c) {
+        to[2 * c] = hexDigits[from[c] >> 4];
+        to[2 * c + 1] = hexDigits[from[c] & 0x0F];
     }
-    memmove(asStringBuffer, from, end);
-    DWORD c;
-    for (c = 0; c < end; ++c) {
-        if (asStringBuffer[c] < ' ') {
-            asStringBuffer[c] = '.';
+}
+
+/** Return the number of bytes from from that need no escape in a C string. */
+static DWORD dumpPlain(const BYTE* from, DWORD length) {
+    DWORD c = 0;
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i quote = _mm_set1_epi8('"');
+    for (; c + 16 <= length; c += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i*) (from + c));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, del), _mm_cmpeq_epi8(b, backslash)),
+                                       _mm_cmpeq_epi8(b, quote));
+        __m128i plain = _mm_andnot_si128(special, _mm_cmpgt_epi8(b, space));
+        int escapes = ~_mm_movemask_epi8(plain) & 0xFFFF;
+        if (escapes != 0) {
+            while ((escapes & 1) == 0) {
+                escapes >>= 1;
+                ++c;
+            }
+            return c;
+        }
+    }
+#endif
+    for (; c < length; ++c) {
+        BYTE b = from[c];
+        if (b < ' ' || b >= 0x7F || b == '\\' || b == '"') break;
+    }
+    return c;
+}
+
+/** Write length bytes from from into to (which has room for space chars)
+    as the contents of a C string literal. Return the number of bytes written.
+    *used is set to the number of bytes from from that were written.
+ */
+static int dumpC(char* to, int space, const BYTE* from, DWORD length, DWORD* used) {
+    int t = 0;
+    DWORD c = 0;
+    while (c < length) {
+        DWORD plain = dumpPlain(from + c, length - c);
+        if (plain > (DWORD) (space - t)) plain = space - t;
+        memcpy(to + t, from + c, plain);
+        t += plain;
+        c += plain;
+        if (c >= length || space - t < 4) break;
+        BYTE b = from[c++];
+        to[t++] = '\\';
+        switch (b) {
+        case '\r': to[t++] = 'r'; break;
+        case '\n': to[t++] = 'n'; break;
+        case '\t': to[t++] = 't'; break;
+        case '\\': case '"': to[t++] = b; break;
+        default:
+            to[t++] = 'x';
+            to[t++] = hexDigits[b >> 4];
+            to[t++] = hexDigits[b & 0x0F];
         }
     }
-    asStringBuffer[end] = 0;
-    return asStringBuffer;
+    *used = c;
+    return t;
+}
+
+/** Format length bytes from from, as dumpMode specifies. */
+static Dump dump(const BYTE* from, DWORD length) {
+    Dump result;
+    const int space = sizeof(result.text) - 4; // for "..." and NUL
+    DWORD toDump = (length > dumpMax) ? dumpMax : length;
+    int end;
+    switch (dumpMode) {
+    case DUMP_HEX:
+        if (toDump > (DWORD) space / 2) toDump = space / 2;
+        dumpHex(result.text, from, toDump);
+        end = 2 * toDump;
+        break;
+    case DUMP_C:
+        end = dumpC(result.text, space, from, toDump, &toDump);
+        break;
+    default:
+        if (toDump > (DWORD) space) toDump = space;
+        dumpPrintable(result.text, from, toDump);
+        end = toDump;
+    }
+    if (toDump < length) {
+        memcpy(result.text + end, "...", 3);
+        end += 3;
+    }
+    result.text[end] = 0;
+    return result;
+}
+
+static DWORD baudRate = CBR_9600;
+
+/* With --rx-gap=<characters>[,<bytes>], comProxy holds data received from a
+   COM port until no more data arrive for that many character times (or it
+   has that many bytes), and then passes them all to the client at once.
+   So a client that reads framed messages (for example Modbus RTU, which
+   separates messages by 3.5 characters of silence) gets whole messages.
+   The held bytes are in rxBuffer's space, following its data.
+   A character time depends on the port's settings, so each port's gap
+   (port->rxGapMicroseconds) is computed from the DCB that the driver
+   reports after setComm: start bit, data bits, parity bit and stop bits,
+   at the actual baud rate. A replayed port has no DCB, so its gap uses the
+   settings setComm would ask for.
+ */
+static double rxGapCharacters = 0; // zero indicates no batching
+static DWORD rxBatchBytes = 0; // zero indicates as many as rxBuffer holds
+
+/* With --tx-coalesce=<microseconds>[,<bytes>[,<delimiter>]], comProxy
+   doesn't write data to a COM port as soon as they arrive. It waits until
+   the first of them has waited that long, or that many bytes are waiting,
+   or the delimiter byte arrives, and then writes them all at once. That
+   saves the overhead of many tiny writes, which is large for USB serial
+   adapters.
+ */
+static LONGLONG txCoalesceMicroseconds = 0; // zero indicates no waiting
+static DWORD txCoalesceBytes = 0; // zero indicates no limit but txBuffer's capacity
+static int txDelimiter = -1; // a byte value, or -1
+
+/* With --rx-flow=rts or --rx-flow=xon, comProxy asks the other end of each
+   COM port to stop sending when rxBuffer (the data not yet taken by the
+   client) holds at least rxFlowHigh bytes, and to resume when it holds no
+   more than rxFlowLow. It does this by clearing and setting RTS, or by
+   sending XOFF and XON. So a slow client slows the sender, instead of
+   data being lost when the driver's input buffer overflows.
+ */
+static const int RX_FLOW_NONE = 0;
+static const int RX_FLOW_RTS = 1;
+static const int RX_FLOW_XON = 2;
+static const char XON_CHAR = 0x11;
+static const char XOFF_CHAR = 0x13;
+static int rxFlowControl = RX_FLOW_NONE;
+static DWORD rxFlowHigh = 0; // zero indicates 3/4 of rxBuffer's capacity
+static DWORD rxFlowLow = 0; // zero indicates 1/4 of rxBuffer's capacity
+static DWORD rxBufferSize = 128; // the capacity of rxBuffer, except with --backlog or --shm
+
+/* With --oob=<escape byte>, the client can send a byte to the COM port ahead
+   of the data that are queued for it, by sending the escape byte followed
+   by that byte. (To send the escape byte itself as ordinary data, send it
+   twice.) comProxy sends such bytes with TransmitCommChar. This works for
+   stdin and pipe clients, but not shared memory, whose data comProxy
+   doesn't examine.
+ */
+static int oobEscape = -1; // a byte value, or -1
+static const int OOB_MAX = 16;
+
+/* With --rx-reads=<number>, comProxy keeps that many reads from each COM port
+   posted all the time, each into its own buffer, instead of reading only
+   after EV_RXCHAR. So the driver always has somewhere to put input data.
+   The reads use timeouts that make ReadFile wait for at least one byte,
+   and then return whatever the driver has (or nothing, after
+   RX_READ_TIMEOUT milliseconds). The reads complete in the order they
+   were posted; the engine copies their data to rxBuffer in that order,
+   and then posts each read again.
+ */
+static int rxReadCount = 0; // zero indicates reading after EV_RXCHAR
+static const int RX_READS_MAX = 8;
+static const DWORD RX_READ_SIZE = 128;
+static const DWORD RX_READ_TIMEOUT = 1000;
+
+/* With --tx-writes=<number>, comProxy keeps up to that many writes to each
+   COM port in flight, so the driver has the next data before it finishes
+   transmitting the current data. Each write is a different range of
+   txBuffer; data are removed from txBuffer as the writes complete, in
+   order. A write that completes short while later writes are in flight
+   would leave a hole in the data. Writes time out (see WriteFile in the
+   notes above), but pipelined writes have a long timeout, and a write is
+   only added to those in flight while CTS is on, so a write that's
+   stopped by flow control doesn't have later writes queued behind it.
+   If a write completes short anyway, comWriteDone cancels the later
+   writes. If none of them wrote anything, it writes again from the first
+   byte that wasn't written; otherwise the data on the line have a hole,
+   and the port fails.
+ */
+static int txWriteCount = 1; // one indicates a single write at a time
+static const int TX_WRITES_MAX = 8;
+static const DWORD TX_PIPELINED_TIMEOUT = 2000; // milliseconds
+
+/** Return how many microseconds rxGapCharacters take, with comState's settings. */
+static LONGLONG rxGapTime(const DCB* comState) {
+    if (rxGapCharacters <= 0 || comState->BaudRate == 0) return 0;
+    double bits = 1 + comState->ByteSize + ((comState->Parity != NOPARITY) ? 1 : 0)
+        + ((comState->StopBits == ONESTOPBIT) ? 1 : (comState->StopBits == ONE5STOPBITS) ? 1.5 : 2);
+    LONGLONG gap = (LONGLONG) (rxGapCharacters * bits * 1000000 / comState->BaudRate);
+    return (gap > 0) ? gap : 1;
 }
 
-/** Initialize the COM port. */
-static int setComm(HANDLE comHandle) {
+/** Initialize the COM port, and set *rxGap to its rxGapTime. */
+static int setComm(HANDLE comHandle, LONGLONG* rxGap) {
     DCB comState = {0};
     comState.DCBlength = sizeof(DCB);
     if (!GetCommState(comHandle, &comState)) {
         logLastError("GetCommState");
         return 2;
     }
-    comState.BaudRate = CBR_9600;
+    comState.BaudRate = baudRate;
     comState.ByteSize = 8;
     comState.Parity   = NOPARITY;
     comState.StopBits = ONESTOPBIT;
@@ -207,13 +911,28 @@ static int setComm(HANDLE comHandle) {
         logLastError("SetCommState");
         return 3;
     }
+    if (!GetCommState(comHandle, &comState)) { // what the driver actually set
+        logLastError("GetCommState");
+    }
+    *rxGap = rxGapTime(&comState);
+    if (*rxGap > 0) {
+        logDebug("rx gap %d usec at %d baud", (int) *rxGap, (int) comState.BaudRate);
+    }
     COMMTIMEOUTS comTimeouts = {0};
     // Timeouts are not used:
     comTimeouts.ReadIntervalTimeout         = MAXDWORD; // read doesn't time out
     comTimeouts.ReadTotalTimeoutConstant    = 0;
     comTimeouts.ReadTotalTimeoutMultiplier  = 0;
+    if (rxReadCount > 0) {
+        // ReadFile waits for a byte, and then returns as many as are available:
+        comTimeouts.ReadTotalTimeoutConstant   = RX_READ_TIMEOUT;
+        comTimeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    }
     comTimeouts.WriteTotalTimeoutConstant   = 10; // prevents WaitCommEvent from completing prematurely
     comTimeouts.WriteTotalTimeoutMultiplier = 0;
+    if (txWriteCount > 1) {
+        comTimeouts.WriteTotalTimeoutConstant = TX_PIPELINED_TIMEOUT; // rarely short
+    }
     if (!SetCommTimeouts(comHandle, &comTimeouts)) {
         logLastError("SetCommTimeouts");
         return 4;
@@ -226,29 +945,51 @@ static int setComm(HANDLE comHandle) {
     return 0;
 }
 
-/** A queue of bytes, with limited capacity. One reader and one writer may access it concurrently. */
+/** A queue of bytes, with limited capacity. One reader and one writer may access it concurrently.
+    The reader or writer may be in another process, if the buffer is shared (see comProxyShm.h).
+*/
 class RingBuffer {
 private:
     DWORD bufferSize;
     BYTE* buffer;
-    DWORD dataIndex = 0; // index of the first data byte in buffer
-    DWORD spaceIndex = 0; // index of the first empty byte in buffer
+    LONG volatile* dataIndex; // index of the first data byte in buffer
+    LONG volatile* spaceIndex; // index of the first empty byte in buffer
+    LONG indices[2] = {0, 0}; // unless they're shared
+    ComProxyShmRing* shared = NULL;
+    HANDLE dataBell = NULL; // rung after adding data to a shared buffer
+    HANDLE spaceBell = NULL; // rung after removing data from a shared buffer
     CRITICAL_SECTION section;
     DWORD findData() {
-        if (spaceIndex >= dataIndex) {
-            return spaceIndex - dataIndex;
+        LONG data = *dataIndex;
+        LONG space = *spaceIndex;
+        if (space >= data) {
+            return space - data;
         } else {
-            return bufferSize - dataIndex;
+            return bufferSize - data;
         }
     }
     DWORD findSpace() {
-        if (spaceIndex >= dataIndex) {
-            return bufferSize - spaceIndex - (dataIndex == 0 ? 1 : 0);
+        LONG data = *dataIndex;
+        LONG space = *spaceIndex;
+        if (space >= data) {
+            return bufferSize - space - (data == 0 ? 1 : 0);
         } else {
-            return dataIndex - spaceIndex - 1;
+            return data - space - 1;
         }
     }
 public:
+    // Statistics:
+    LONGLONG added = 0; // bytes
+    LONGLONG removed = 0; // bytes
+    DWORD overruns = 0; // including underruns
+    /** Copy the statistics, which other threads may be changing. */
+    void statistics(LONGLONG* addedNow, LONGLONG* removedNow, DWORD* overrunsNow) {
+        EnterCriticalSection(&section);
+        *addedNow = added;
+        *removedNow = removed;
+        *overrunsNow = overruns;
+        LeaveCriticalSection(&section);
+    }
     // Waitable events:
     const HANDLE notFull = CreateEvent(0, TRUE, TRUE, NULL); // hasSpace
     const HANDLE notEmpty = CreateEvent(0, TRUE, FALSE, NULL); // hasData
@@ -257,22 +998,91 @@ public:
         InitializeCriticalSection(&section);
         bufferSize = capacity + 1;
         buffer = new BYTE[bufferSize];
+        dataIndex = &indices[0];
+        spaceIndex = &indices[1];
     }
     ~RingBuffer() {
-        delete[] buffer;
+        if (shared == NULL) delete[] buffer;
         DeleteCriticalSection(&section);
     }
+    /** Use a buffer in shared memory, instead of the one from the constructor. */
+    void share(ComProxyShmRing* ring, BYTE* sharedBuffer, LONG size,
+               HANDLE sharedDataBell, HANDLE sharedSpaceBell) {
+        delete[] buffer;
+        buffer = sharedBuffer;
+        bufferSize = size;
+        shared = ring;
+        dataIndex = &ring->dataIndex;
+        spaceIndex = &ring->spaceIndex;
+        dataBell = sharedDataBell;
+        spaceBell = sharedSpaceBell;
+    }
+    BOOL isShared() {
+        return shared != NULL;
+    }
+    /** Keep the buffer in physical memory. */
+    void lockMemory() {
+        if (!VirtualLock(buffer, bufferSize)) logLastError("VirtualLock RingBuffer");
+    }
+    /** Ask the writer to ring dataBell after it adds data.
+        Return TRUE if it added data already.
+    */
+    BOOL awaitData() {
+        if (shared == NULL) return FALSE;
+        InterlockedExchange(&shared->consumerWaiting, 1);
+        return hasData() > 0;
+    }
+    /** Ask the reader to ring spaceBell after it removes data.
+        Return TRUE if it removed data already.
+    */
+    BOOL awaitSpace() {
+        if (shared == NULL) return FALSE;
+        InterlockedExchange(&shared->producerWaiting, 1);
+        return hasSpace() > 0;
+    }
+    /** Tell the reader no more data will be added. */
+    void close() {
+        if (shared != NULL) {
+            InterlockedExchange(&shared->closed, 1);
+            SetEvent(dataBell);
+        }
+    }
+    /** Return TRUE if the writer won't add more data, and all the data have been removed. */
+    BOOL isClosed() {
+        if (shared == NULL || !shared->closed) return FALSE;
+        MemoryBarrier(); // Check for data after checking closed.
+        return hasData() <= 0;
+    }
     BYTE* data() {
         BYTE* result;
         EnterCriticalSection(&section);
-        result = &buffer[dataIndex];
+        result = &buffer[*dataIndex];
+        LeaveCriticalSection(&section);
+        return result;
+    }
+    /** Return the address of the data that follow the first offset bytes of data,
+        and set *length to the number of them that are contiguous.
+    */
+    BYTE* dataAfter(DWORD offset, DWORD* length) {
+        BYTE* result = NULL;
+        EnterCriticalSection(&section);
+        LONG data = *dataIndex;
+        LONG space = *spaceIndex;
+        DWORD total = (space >= data) ? (space - data) : (bufferSize - data + space);
+        *length = 0;
+        if (offset < total) {
+            LONG from = data + offset;
+            if (from >= (LONG) bufferSize) from -= bufferSize;
+            result = &buffer[from];
+            *length = (space > from) ? (space - from) : (bufferSize - from);
+        }
         LeaveCriticalSection(&section);
         return result;
     }
     BYTE* space() {
         BYTE* result;
         EnterCriticalSection(&section);
-        result = &buffer[spaceIndex];
+        result = &buffer[*spaceIndex];
         LeaveCriticalSection(&section);
         return result;
     }
@@ -290,6 +1100,41 @@ public:
         LeaveCriticalSection(&section);
         return result;
     }
+    DWORD capacity() {
+        return bufferSize - 1;
+    }
+    DWORD dataTotal() { // number of bytes that can be removed, not necessarily contiguously
+        DWORD result;
+        EnterCriticalSection(&section);
+        LONG data = *dataIndex;
+        LONG space = *spaceIndex;
+        result = (space >= data) ? (space - data) : (bufferSize - data + space);
+        LeaveCriticalSection(&section);
+        return result;
+    }
+    DWORD spaceTotal() { // number of bytes that can be added, not necessarily contiguously
+        DWORD result;
+        EnterCriticalSection(&section);
+        LONG data = *dataIndex;
+        LONG space = *spaceIndex;
+        result = (data > space) ? (data - space - 1) : (bufferSize - 1 - (space - data));
+        LeaveCriticalSection(&section);
+        return result;
+    }
+    /** Copy count bytes into the buffer, if there's space for all of them.
+        Return FALSE if there isn't. */
+    BOOL put(const BYTE* from, DWORD count) {
+        if (spaceTotal() < count) return FALSE;
+        while (count > 0) {
+            DWORD toAdd = hasSpace();
+            if (toAdd > count) toAdd = count;
+            memmove(space(), from, toAdd);
+            addData(toAdd);
+            from += toAdd;
+            count -= toAdd;
+        }
+        return TRUE;
+    }
     void addData(DWORD count) {
         if (count > 0) {
             DWORD resetError = ERROR_SUCCESS;
@@ -298,19 +1143,30 @@ public:
             DWORD toAdd = findSpace();
             if (count > toAdd) {
                 logInfo("buffer overrun %d > %d", count, toAdd);
+                flightDump("buffer overrun");
+                ++overruns;
             } else {
                 toAdd = count;
             }
-            spaceIndex += toAdd;
-            if (spaceIndex == bufferSize) {
-                spaceIndex = 0;
-            }
-            //logTrace("SetEvent(notEmpty)");
-            if (!SetEvent(notEmpty)) {
-                setError = GetLastError();
+            added += toAdd;
+            LONG nextSpace = *spaceIndex + toAdd;
+            if (nextSpace == bufferSize) {
+                nextSpace = 0;
             }
-            if (findSpace() <= 0 && !ResetEvent(notFull)) {
-                resetError = GetLastError();
+            InterlockedExchange(spaceIndex, nextSpace);
+            if (shared != NULL) {
+                // The reader is in another process, which doesn't use notEmpty.
+                if (InterlockedExchange(&shared->consumerWaiting, 0) && !SetEvent(dataBell)) {
+                    setError = GetLastError();
+                }
+            } else {
+                //logTrace("SetEvent(notEmpty)");
+                if (!SetEvent(notEmpty)) {
+                    setError = GetLastError();
+                }
+                if (findSpace() <= 0 && !ResetEvent(notFull)) {
+                    resetError = GetLastError();
+                }
             }
             LeaveCriticalSection(&section);
             if (resetError != ERROR_SUCCESS) logError("ResetEvent RingBuffer.notFull", resetError);
@@ -325,18 +1181,29 @@ public:
             DWORD toRemove = findData();
             if (count > toRemove) {
                 logInfo("buffer underrun %d > %d", count, toRemove);
+                flightDump("buffer underrun");
+                ++overruns;
             } else {
                 toRemove = count;
             }
-            dataIndex += toRemove;
-            if (dataIndex == bufferSize) {
-                dataIndex = 0;
+            removed += toRemove;
+            LONG nextData = *dataIndex + toRemove;
+            if (nextData == bufferSize) {
+                nextData = 0;
             }
-            if (!SetEvent(notFull)) {
-                setError = GetLastError();
-            }
-            if (findData() <= 0 && !ResetEvent(notEmpty)) {
-                resetError = GetLastError();
+            InterlockedExchange(dataIndex, nextData);
+            if (shared != NULL) {
+                // The writer is in another process, which doesn't use notFull.
+                if (InterlockedExchange(&shared->producerWaiting, 0) && !SetEvent(spaceBell)) {
+                    setError = GetLastError();
+                }
+            } else {
+                if (!SetEvent(notFull)) {
+                    setError = GetLastError();
+                }
+                if (findData() <= 0 && !ResetEvent(notEmpty)) {
+                    resetError = GetLastError();
+                }
             }
             LeaveCriticalSection(&section);
             if (resetError != ERROR_SUCCESS) logError("ResetEvent RingBuffer.notEmpty", resetError);
@@ -345,351 +1212,3234 @@ public:
     }
 };
 
-static RingBuffer rxBuffer(128); // bytes moving from the COM port
-static RingBuffer txBuffer(128); // bytes moving to the COM port
+/* The engine: all the COM port (and pipe) handles are associated with one
+   I/O completion port, and engine threads handle each operation as it
+   completes. WaitForMultipleObjects can't wait for more than 64 objects,
+   and waiting for events requires resetting them carefully (see above).
+   A completion packet can't be lost that way, and it identifies the
+   Operation that completed.
 
-static DWORD WINAPI stdinReader(LPVOID parameter) {
-    while (TRUE) {
-        DWORD toRead = txBuffer.hasSpace();
-        if (toRead <= 0) {
-            WaitForSingleObject(txBuffer.notFull, INFINITE);
-            continue;
+   With a completion port, every overlapped operation that doesn't fail
+   immediately queues a completion packet, even if it succeeded immediately.
+   So an Operation is pending from the time it's started until its
+   completion packet is dequeued, regardless of what ReadFile etc. returned.
+
+   Each Port has a lock, which is held while one of its operations completes.
+   So several engine threads may serve several Ports, but only one thread at
+   a time handles any given Port.
+
+   In multi-port mode, each COM port is paired with a named pipe, through
+   which one client at a time can do I/O through the COM port. When a client
+   disconnects, the COM port stays open and another client can connect.
+   There are no threads other than the engine.
+ */
+class Port;
+struct Replay;
+
+/* Counters of I/O events, which comProxy logs periodically with
+   --stats=<seconds>, and at exit. The client's data are counted by
+   RingBuffer (as added to txBuffer and removed from rxBuffer).
+ */
+static const int COM_EVENT_BITS = 9; // EV_RXCHAR ... EV_RING
+static const char* comEventNames[COM_EVENT_BITS] = {
+    "RXCHAR", "RXFLAG", "TXEMPTY", "CTS", "DSR", "RLSD", "BREAK", "ERR", "RING"};
+struct Counters {
+    LONGLONG rxBytes; // read from the COM port
+    LONGLONG txBytes; // written to the COM port
+    DWORD reads; // ReadFile calls
+    DWORD writes; // WriteFile calls
+    DWORD rxZero; // reads that completed with no data
+    DWORD txZero; // writes that completed with no data written
+    DWORD ioPending; // operations that started with ERROR_IO_PENDING
+    DWORD retryTimeouts; // calls to retry
+    DWORD rxStalls; // comRx found rxBuffer full
+    DWORD txStalls; // clientRead found txBuffer full
+    DWORD comEvents[COM_EVENT_BITS]; // the number of each EV_* bit from WaitCommEvent
+};
+
+/* A read or write may complete with zero bytes, and WaitCommEvent doesn't
+   always indicate when to try again. So after a zero byte completion, the
+   engine retries the operation after a delay, which starts at RETRY_MIN
+   microseconds and doubles after each retry, up to RETRY_MAX. Transferring
+   some data resets the delay to RETRY_MIN. So retries are frequent while
+   data are flowing, and rare when the port is idle.
+   The engine waits for a retry by GetQueuedCompletionStatus, whose timeout
+   is in milliseconds and is rounded up to the system timer's resolution
+   (often 15.6 msec). So RETRY_MIN is a millisecond, and a retry may happen
+   later than scheduled; only --spin polls more precisely.
+ */
+static const LONGLONG RETRY_MIN = 1000;
+static const LONGLONG RETRY_MAX = 2000000;
+
+/* Bonded mode: the data from stdin are divided into fragments, which are
+   transmitted through several COM ports (links) concurrently. Each fragment
+   is framed as:
+       BOND_SYNC, sequence number (2 bytes, little-endian), payload length,
+       payload, CRC-8 of the sequence number, length and payload.
+   The peer comProxy (also in bonded mode) receives fragments from all the
+   links, and writes their payloads to stdout in sequence. Each fragment is
+   transmitted through the link with the most buffer space, so faster links
+   carry more fragments.
+
+   When a link fails, the frames in its txBuffer (which may not have been
+   transmitted) are requeued, and transmitted through the remaining links
+   before any new fragments.
+
+   A fragment may be lost, for example if a link fails while transmitting
+   it, or a frame is corrupted. The receiver waits for a missing fragment until BOND_WINDOW
+   later fragments have arrived, or until the engine is idle for a while,
+   and then skips it.
+ */
+static const BYTE BOND_SYNC = 0xB5;
+static const DWORD BOND_MAX_PAYLOAD = 60;
+static const DWORD BOND_FRAME_OVERHEAD = 5;
+static const WORD BOND_WINDOW = 64; // fragments that may be received out of order
+static const LONGLONG BOND_WAIT = 1000000; // microseconds to wait for a missing fragment
+
+struct BondLink {
+    Port* port;
+    BYTE frame[2 * (BOND_MAX_PAYLOAD + BOND_FRAME_OVERHEAD)]; // received bytes
+    DWORD frameLength;
+    // Statistics:
+    DWORD txFragments;
+    DWORD txBytes;
+    DWORD rxFragments;
+    DWORD rxBytes;
+    DWORD rxErrors; // corrupt frames
+};
+
+/** A client (stdin and stdout) and the COM ports through which it exchanges data. */
+struct Bond {
+    Port* client;
+    BondLink* links;
+    int linkCount;
+    WORD txSequence; // of the next fragment to transmit
+    WORD rxSequence; // of the next fragment to deliver to the client
+    BYTE fragments[BOND_WINDOW][BOND_MAX_PAYLOAD]; // received out of order
+    BYTE fragmentLengths[BOND_WINDOW]; // zero indicates no fragment
+    WORD fragmentSequences[BOND_WINDOW];
+    LONGLONG waitingSince; // microseconds() when rxSequence was first missing, or zero
+    BYTE* requeued; // frames from failed links, to transmit through other links
+    DWORD requeuedLength;
+    DWORD requeuedSize; // of requeued
+    DWORD lost; // fragments skipped
+};
+
+/** An operation on a Port. When it completes, the engine calls complete
+    while holding the Port's lock.
+ */
+struct Operation {
+    OVERLAPPED overlapped; // must be first; the CompletionQueue returns its address
+    Port* port;
+    void (*complete)(Port* port, DWORD error, DWORD count);
+    BOOL pending; // a completion packet will be queued
+    LONG volatile posted; // postOperation queued a completion packet
+    LONGLONG postedAt; // microseconds() when postOperation queued it
+};
+
+/** One of the reads that are always posted, with --rx-reads. */
+struct RxRead {
+    Operation op;
+    BYTE data[RX_READ_SIZE];
+    BOOL reading; // posted and not yet handled by comReadDone
+    BOOL full; // completed, and data not yet copied to rxBuffer
+    DWORD count; // bytes read
+    DWORD copied; // bytes copied to rxBuffer
+};
+
+/** The end of the data from a completed COM read, which the client hasn't
+    taken yet, and when the read completed (see rxArrived).
+ */
+struct RxArrival {
+    LONGLONG end; // Port.rxReceived after the read
+    LONGLONG at; // microseconds()
+};
+static const int RX_ARRIVALS = 16;
+
+/** One of the writes that may be in flight, with --tx-writes. */
+struct TxWrite {
+    Operation op;
+    BOOL writing; // started and not yet handled by comWriteDone
+    BOOL done; // completed, and data not yet removed from txBuffer
+    DWORD count; // bytes to write
+    DWORD written;
+};
+
+static const DWORD CAPTURE_NONE = 0xFFFFFFFF; // a Port's interfaces aren't in the capture (yet)
+
+/** A COM port, and the client that uses it: stdin and stdout, shared memory or a named pipe. */
+class Port {
+public:
+    const char* comName;
+    const char* pipeName; // NULL indicates stdin and stdout, or shared memory
+    const char* shmName = NULL; // shared with the parent process
+    ComProxyShmView shm = {0};
+    HANDLE comHandle = INVALID_HANDLE_VALUE;
+    HANDLE pipeHandle = INVALID_HANDLE_VALUE;
+    CRITICAL_SECTION lock;
+    DWORD comEventMask = 0;
+    BOOL comDone = FALSE;
+    BOOL clientConnected = FALSE;
+    BOOL rxStalled = FALSE; // rxBuffer was full, so comRx is not pending
+    BOOL txStalled = FALSE; // txBuffer was full, so clientRead is not pending
+    BOOL active = FALSE; // counted in activePorts
+    BOOL isBroker = FALSE; // opens other Ports (see brokerListen)
+    Bond* bond = NULL; // in bonded mode
+    int bondLink = -1; // index in bond->links, or -1 for the bond's client
+    LONGLONG retryDue = 0; // microseconds(), or zero if no retry is scheduled
+    LONGLONG retryDelay = RETRY_MIN; // microseconds
+    BOOL rxRetried = FALSE; // comRx.pending was started by retry
+    BOOL txRetried = FALSE; // comTx.pending was started by retry
+    DWORD retries = 0; // retried operations that transferred data
+    Counters counters = {0};
+    WORD traceIndex = 0; // in traceHeader->portNames
+    DWORD volatile captureInterface = CAPTURE_NONE; // the first of its two interfaces in the capture
+    BOOL captureLogged = FALSE; // that it isn't captured
+    DWORD rxQueueMax = 0; // the most bytes ClearCommError found in the input buffer
+    DWORD frameErrors = 0;
+    DWORD overrunErrors = 0; // the hardware buffer overflowed
+    DWORD rxOverErrors = 0; // the driver's input buffer overflowed
+    DWORD parityErrors = 0;
+    DWORD breaks = 0;
+    Operation comEvent = {0};
+    Operation comRx = {0};
+    Operation comTx = {0};
+    RxRead* rxReads = NULL; // rxReadCount reads, or NULL
+    int rxReadNext = 0; // index in rxReads of the oldest read
+    TxWrite* txWrites = NULL; // txWriteCount writes, or NULL
+    int txWriteNext = 0; // index in txWrites of the oldest write
+    int txWriting = 0; // number of txWrites in flight (or done and not yet removed)
+    DWORD txInFlight = 0; // bytes at the start of txBuffer that are being written
+    BOOL txRewinding = FALSE; // a pipelined write was short, and later writes are being canceled
+    DWORD txRewinds = 0; // short pipelined writes, after which the rest was written again
+    DWORD rxHeld = 0; // bytes received but not yet added to rxBuffer (see rxGapCharacters)
+    LONGLONG rxReceived = 0; // bytes read from the COM port, counted from where rxBuffer.added was
+    RxArrival rxArrivals[RX_ARRIVALS]; // a ring of reads the client hasn't taken, oldest first
+    int rxArrivalFirst = 0;
+    int rxArrivalCount = 0;
+    LONGLONG rxGapMicroseconds = 0; // rxGapCharacters at this port's baud rate
+    LONGLONG rxFlushDue = 0; // when to add them, or zero
+    BOOL rxFlowStopped = FALSE; // asked the other end to stop sending (see rxFlowControl)
+    DWORD rxFlowStops = 0;
+    BOOL oobEscaped = FALSE; // the last byte from the client was oobEscape
+    BYTE oobBytes[OOB_MAX]; // waiting for TransmitCommChar
+    LONGLONG oobSince[OOB_MAX]; // when each of them was received
+    int oobCount = 0;
+    DWORD oobSent = 0;
+    DWORD oobDropped = 0;
+    LONGLONG oobLatencyTotal = 0; // microseconds
+    LONGLONG oobLatencyMax = 0; // microseconds
+    LONGLONG txWaitingSince = 0; // when comTx started waiting for more data (see txCoalesceMicroseconds)
+    LONGLONG txFlushDue = 0; // when it will stop waiting, or zero
+    LONGLONG txIdleSince = 0; // when the last write completed with more data waiting
+    DWORD txGaps = 0; // number of times the line was idle with data waiting
+    LONGLONG txGapTotal = 0; // microseconds
+    LONGLONG txGapMax = 0; // microseconds
+    Operation clientConnect = {0};
+    Operation clientRead = {0}; // from the pipe, stdin or shared memory
+    Operation clientWrite = {0}; // to the pipe, stdout or shared memory
+    Operation oobSend = {0}; // posted by stdinReader
+    Replay* replay = NULL; // replaces the COM port, with --replay
+    RingBuffer rxBuffer; // bytes moving from the COM port
+    RingBuffer txBuffer; // bytes moving to the COM port
+    Port* next = NULL;
+
+    Port(const char* comName, const char* pipeName, DWORD rxCapacity = 128)
+        : comName(comName), pipeName(pipeName), rxBuffer(rxCapacity), txBuffer(128) {
+        InitializeCriticalSection(&lock);
+    }
+    /** Return FALSE if there's nothing more to do. */
+    BOOL isActive() {
+        if (isBroker) return TRUE; // until the process is killed
+        if (bond != NULL && bondLink >= 0) return FALSE; // The bond's client is counted.
+        if (pipeName == NULL) {
+            BOOL txDone = comDone || (stdinDone && txBuffer.hasData() <= 0);
+            for (int l = 0; bond != NULL && l < bond->linkCount; ++l) {
+                Port* link = bond->links[l].port;
+                if (!link->comDone && link->txBuffer.hasData() > 0) txDone = FALSE;
+            }
+            return !((stdoutDone || rxBuffer.hasData() <= 0) && txDone);
         }
-        DWORD wasRead = _read(stdinNumber, txBuffer.space(), toRead);
-        if (wasRead < 0) {
-            perror("_read(stdin)");
-            stdinDone = TRUE;
-            return errno;
+        for (int r = 0; rxReads != NULL && r < rxReadCount; ++r) {
+            if (rxReads[r].op.pending) return TRUE;
         }
-        logDebug("stdin read %d %s", wasRead, asString(txBuffer.space(), wasRead));
-        txBuffer.addData(wasRead);
-        if (wasRead == 0) {
-            stdinDone = TRUE;
-            return 0;
+        for (int w = 0; txWrites != NULL && w < txWriteCount; ++w) {
+            if (txWrites[w].op.pending) return TRUE;
         }
+        return !comDone
+            || comEvent.pending || comRx.pending || comTx.pending
+            || clientConnect.pending || clientRead.pending || clientWrite.pending;
     }
-}
+};
 
-static DWORD WINAPI stdoutWriter(LPVOID parameter) {
-    while (TRUE) {
-        DWORD toWrite = rxBuffer.hasData();
-        if (toWrite <= 0) {
-            WaitForSingleObject(rxBuffer.notEmpty, INFINITE);
-            continue;
+/** The source of completed operations. Overlapped I/O on an associated
+    handle completes via an I/O completion port. Other threads complete
+    operations by posting them; for example the stdin and stdout threads,
+    or anything else that simulates an operation without a device.
+    A test may define COM_PROXY_COMPLETION_QUEUE as a header that defines
+    another CompletionQueue, with the same methods (see test/).
+ */
+#ifdef COM_PROXY_COMPLETION_QUEUE
+#include COM_PROXY_COMPLETION_QUEUE
+#else
+class CompletionQueue {
+private:
+    HANDLE handle = NULL;
+public:
+    DWORD open(DWORD threads) {
+        handle = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, threads);
+        return (handle != NULL) ? ERROR_SUCCESS : GetLastError();
+    }
+    DWORD associate(HANDLE file, Port* port) {
+        return (CreateIoCompletionPort(file, handle, (ULONG_PTR) port, 0) != NULL)
+            ? ERROR_SUCCESS : GetLastError();
+    }
+    DWORD post(Operation* op, DWORD count) {
+        return PostQueuedCompletionStatus(handle, count, (ULONG_PTR) op->port, &op->overlapped)
+            ? ERROR_SUCCESS : GetLastError();
+    }
+    /** Cause next to return ERROR_SUCCESS and no Operation, once in each of threads. */
+    void stop(DWORD threads) {
+        for (DWORD t = 0; t < threads; ++t) {
+            if (!PostQueuedCompletionStatus(handle, 0, 0, NULL)) {
+                logLastError("PostQueuedCompletionStatus");
+            }
         }
-        DWORD wasWritten = _write(stdoutNumber, rxBuffer.data(), toWrite);
-        if (wasWritten < 0) {
+    }
+    /** Wait for an operation to complete, and return its error code.
+        If none completes, set *op to NULL and return WAIT_TIMEOUT,
+        or ERROR_SUCCESS if stopped, or some other error.
+     */
+    DWORD next(Operation** op, DWORD* count, DWORD timeout) {
+        ULONG_PTR key = 0;
+        LPOVERLAPPED overlapped = NULL;
+        DWORD err = GetQueuedCompletionStatus(handle, count, &key, &overlapped, timeout)
+            ? ERROR_SUCCESS : GetLastError();
+        *op = (Operation*) overlapped;
+        return err;
+    }
+};
+#endif
+
+static CompletionQueue completions;
+static Port* ports = NULL;
+static Port** lastPort = &ports;
+static DWORD backlogSize = 0; // bytes from a COM port to keep while no client is connected
+static LONG volatile activePorts = 0;
+static DWORD engineThreads = 1;
+
+/** Prepare op to be passed to an overlapped I/O function. */
+static LPOVERLAPPED startOperation(Operation* op, Port* port,
+                                   void (*complete)(Port*, DWORD, DWORD)) {
+    memset(&op->overlapped, 0, sizeof(op->overlapped));
+    op->port = port;
+    op->complete = complete;
+    return &op->overlapped;
+}
+
+/** Note the result of starting an overlapped operation.
+    Return the error code, or ERROR_SUCCESS if a completion packet will be queued.
+ */
+static DWORD startedOperation(Operation* op, BOOL started) {
+    DWORD err = started ? ERROR_SUCCESS : GetLastError();
+    if (err == ERROR_IO_PENDING && op->port != NULL) ++op->port->counters.ioPending;
+    if (err == ERROR_SUCCESS || err == ERROR_IO_PENDING) {
+        op->pending = TRUE;
+        return ERROR_SUCCESS;
+    }
+    return err;
+}
+
+/** Complete op from some thread other than the engine.
+    Do nothing if op was already posted and hasn't completed yet.
+ */
+static void postOperation(Operation* op) {
+    if (InterlockedExchange(&op->posted, TRUE) == FALSE) {
+        op->postedAt = microseconds();
+        DWORD err = completions.post(op, 0);
+        if (err != ERROR_SUCCESS) logError("PostQueuedCompletionStatus", err);
+    }
+}
+
+/** Stop the engine after the last port becomes inactive. */
+static void checkActive(Port* port) {
+    if (port->active && !port->isActive()) {
+        port->active = FALSE;
+        if (InterlockedDecrement(&activePorts) <= 0) {
+            completions.stop(engineThreads);
+        }
+    }
+}
+
+/* With --trace=<file>[,<records>], comProxy records I/O events in a binary
+   trace file (see comProxyTrace.h), which comProxyTraceDecode can print.
+ */
+static ComProxyTraceHeader* traceHeader = NULL;
+static ComProxyTraceRecord* traceRecords = NULL;
+static HANDLE traceFile = INVALID_HANDLE_VALUE;
+static HANDLE traceMapping = NULL;
+
+static DWORD openTrace(const char* fileName, LONG capacity) {
+    traceFile = CreateFile(fileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+                           NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (traceFile == INVALID_HANDLE_VALUE) return GetLastError();
+    ULARGE_INTEGER size;
+    size.QuadPart = sizeof(ComProxyTraceHeader) + ((ULONGLONG) capacity) * sizeof(ComProxyTraceRecord);
+    traceMapping = CreateFileMapping(traceFile, NULL, PAGE_READWRITE, size.HighPart, size.LowPart, NULL);
+    if (traceMapping == NULL) return GetLastError();
+    traceHeader = (ComProxyTraceHeader*) MapViewOfFile(traceMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (traceHeader == NULL) return GetLastError();
+    traceRecords = (ComProxyTraceRecord*) (traceHeader + 1);
+    traceHeader->version = COM_PROXY_TRACE_VERSION;
+    traceHeader->recordSize = sizeof(ComProxyTraceRecord);
+    traceHeader->capacity = capacity;
+    if (clockStart == 0) startClock();
+    traceHeader->startTime = clockStart;
+    traceHeader->startWallTime.dwLowDateTime = (DWORD) clockStartWall;
+    traceHeader->startWallTime.dwHighDateTime = (DWORD) (clockStartWall >> 32);
+    MemoryBarrier();
+    traceHeader->magic = COM_PROXY_TRACE_MAGIC;
+    return ERROR_SUCCESS;
+}
+
+static void closeTrace() {
+    if (traceHeader != NULL) {
+        ComProxyTraceHeader* header = traceHeader;
+        traceHeader = NULL;
+        FlushViewOfFile(header, 0);
+        UnmapViewOfFile(header);
+    }
+    if (traceMapping != NULL) CloseHandle(traceMapping);
+    if (traceFile != INVALID_HANDLE_VALUE) CloseHandle(traceFile);
+}
+
+/* With --capture=<file>, comProxy records the data it reads from and
+   writes to each COM port, and its COM events, in a pcapng file, which
+   Wireshark and other tools can read. Each port has two interfaces in the
+   file: the first (number port->captureInterface) has LINKTYPE_USER0, and
+   its packets are data, with their direction in epb_flags; the second has
+   LINKTYPE_USER1, and its packets are COM events: the WaitCommEvent mask
+   followed by GetCommModemStatus, as 32-bit little-endian integers.
+   Timestamps are in microseconds since 1970. Interfaces are numbered in
+   the order their blocks are added to the file, which needn't be the
+   order of traceIndex; a port's packets are only captured once its
+   interfaces have been added.
+
+   Threads add blocks to a memory buffer, and a writer thread writes the
+   buffer to the file while threads add to a second buffer. So capturing
+   doesn't wait for the file. If the buffer is full, blocks are dropped
+   (and counted) rather than waited for.
+ */
+static const DWORD CAPTURE_BUFFER_SIZE = 1 << 20;
+static const DWORD PCAPNG_SECTION_HEADER = 0x0A0D0D0A;
+static const DWORD PCAPNG_INTERFACE = 1;
+static const DWORD PCAPNG_PACKET = 6; // an Enhanced Packet Block
+static const DWORD LINKTYPE_USER0 = 147;
+static const DWORD LINKTYPE_USER1 = 148;
+static const DWORD CAPTURE_INBOUND = 1; // in epb_flags
+static const DWORD CAPTURE_OUTBOUND = 2;
+static CRITICAL_SECTION captureLock;
+static BYTE* captureBuffers[2] = {NULL, NULL};
+static int captureFilling = 0; // blocks are added to captureBuffers[captureFilling]
+static DWORD captureLength = 0; // of captureBuffers[captureFilling]
+static HANDLE captureFile = INVALID_HANDLE_VALUE;
+static HANDLE captureBell = NULL; // rung when the buffer is half full
+static HANDLE captureThread = NULL;
+static BOOL volatile captureStopping = FALSE;
+static LONG volatile captureDropped = 0;
+static DWORD captureInterfaceCount = 0; // interfaces added to the capture; locked by captureLock
+
+/** Return the length of a block (see captureBlock). */
+static DWORD captureBlockLength(DWORD bodyLength, DWORD dataLength, DWORD optionsLength) {
+    return 12 + bodyLength + ((dataLength + 3) & ~3) + optionsLength;
+}
+
+/** Add a block to the capture buffer, which must have room for it.
+    The caller must hold captureLock.
+ */
+static void captureBlockLocked(DWORD type, const void* body, DWORD bodyLength,
+                               const void* data, DWORD dataLength,
+                               const void* options, DWORD optionsLength) {
+    DWORD padding = (4 - (dataLength & 3)) & 3;
+    DWORD length = captureBlockLength(bodyLength, dataLength, optionsLength);
+    BYTE* block = captureBuffers[captureFilling] + captureLength;
+    if (captureLength < CAPTURE_BUFFER_SIZE / 2 && captureLength + length >= CAPTURE_BUFFER_SIZE / 2) {
+        SetEvent(captureBell);
+    }
+    captureLength += length;
+    memcpy(block, &type, 4);
+    memcpy(block + 4, &length, 4);
+    memcpy(block + 8, body, bodyLength);
+    block += 8 + bodyLength;
+    if (dataLength > 0) memcpy(block, data, dataLength);
+    memset(block + dataLength, 0, padding);
+    block += dataLength + padding;
+    memcpy(block, options, optionsLength);
+    memcpy(block + optionsLength, &length, 4);
+}
+
+/** Add a block to the capture buffer. The block contains body, then data
+    padded to a multiple of 4 bytes, then options (ending with opt_endofopt).
+ */
+static void captureBlock(DWORD type, const void* body, DWORD bodyLength,
+                         const void* data, DWORD dataLength,
+                         const void* options, DWORD optionsLength) {
+    DWORD length = captureBlockLength(bodyLength, dataLength, optionsLength);
+    EnterCriticalSection(&captureLock);
+    if (captureLength + length > CAPTURE_BUFFER_SIZE) {
+        LeaveCriticalSection(&captureLock);
+        InterlockedIncrement(&captureDropped);
+        return;
+    }
+    captureBlockLocked(type, body, bodyLength, data, dataLength, options, optionsLength);
+    LeaveCriticalSection(&captureLock);
+}
+
+/** Add a packet to the capture, on interface. */
+static void capturePacket(DWORD interfaceId, DWORD flags, const void* data, DWORD length) {
+    ULONGLONG time = (clockStartWall / 10) - 11644473600000000LL // from 1601 to 1970
+        + (microseconds() - clockStart);
+    DWORD body[5] = {interfaceId, (DWORD) (time >> 32), (DWORD) time, length, length};
+    DWORD options[] = {2 | (4 << 16), flags, 0}; // epb_flags, opt_endofopt
+    if (flags != 0) {
+        captureBlock(PCAPNG_PACKET, body, sizeof(body), data, length, options, sizeof(options));
+    } else {
+        captureBlock(PCAPNG_PACKET, body, sizeof(body), data, length, options + 2, 4);
+    }
+}
+
+/** Describe port's two interfaces (data and events) in the capture, unless
+    that's done already. Both are added, or (if the buffer is full) neither.
+    Return FALSE if they haven't been added.
+ */
+static BOOL captureInterfaces(Port* port) {
+    if (captureFile == INVALID_HANDLE_VALUE) return FALSE;
+    if (port->captureInterface != CAPTURE_NONE) return TRUE;
+    DWORD nameLength = strlen(port->comName);
+    if (nameLength > 200) nameLength = 200;
+    BYTE options[2][4 + 204 + 8 + 4];
+    DWORD o = 0;
+    for (int i = 0; i < 2; ++i) {
+        o = 0;
+        DWORD header = 2 | (nameLength << 16); // if_name
+        memcpy(options[i] + o, &header, 4);
+        memcpy(options[i] + o + 4, port->comName, nameLength);
+        memset(options[i] + o + 4 + nameLength, 0, 4);
+        o += 4 + ((nameLength + 3) & ~3);
+        header = 9 | (1 << 16); // if_tsresol
+        memcpy(options[i] + o, &header, 4);
+        DWORD resolution = 6; // microseconds
+        memcpy(options[i] + o + 4, &resolution, 4);
+        o += 8;
+        memset(options[i] + o, 0, 4); // opt_endofopt
+        o += 4;
+    }
+    DWORD bodies[2][2] = {{LINKTYPE_USER0, 0}, {LINKTYPE_USER1, 0}}; // LinkType, Reserved and SnapLen
+    DWORD length = captureBlockLength(sizeof(bodies[0]), 0, o);
+    EnterCriticalSection(&captureLock);
+    BOOL added = (port->captureInterface != CAPTURE_NONE);
+    if (!added && captureLength + 2 * length <= CAPTURE_BUFFER_SIZE) {
+        captureBlockLocked(PCAPNG_INTERFACE, bodies[0], sizeof(bodies[0]), NULL, 0, options[0], o);
+        captureBlockLocked(PCAPNG_INTERFACE, bodies[1], sizeof(bodies[1]), NULL, 0, options[1], o);
+        port->captureInterface = captureInterfaceCount;
+        captureInterfaceCount += 2;
+        added = TRUE;
+    }
+    LeaveCriticalSection(&captureLock);
+    if (!added && !port->captureLogged) {
+        port->captureLogged = TRUE;
+        logInfo("%s isn't captured until the capture buffer has room", port->comName);
+    }
+    return added;
+}
+
+/** Capture data that were read from (CAPTURE_INBOUND) or written to port. */
+static void captureData(Port* port, DWORD direction, const BYTE* data, DWORD length) {
+    if (!captureInterfaces(port)) return;
+    capturePacket(port->captureInterface, direction, data, length);
+}
+
+/** Capture a COM event, and the state of the modem control lines. */
+static void captureEvent(Port* port, DWORD mask) {
+    if (!captureInterfaces(port)) return;
+    DWORD event[2] = {mask, 0};
+    GetCommModemStatus(port->comHandle, &event[1]);
+    capturePacket(port->captureInterface + 1, 0, event, sizeof(event));
+}
+
+static DWORD WINAPI captureWriter(LPVOID parameter) {
+    while (TRUE) {
+        BOOL stopping = captureStopping;
+        EnterCriticalSection(&captureLock);
+        BYTE* buffer = captureBuffers[captureFilling];
+        DWORD length = captureLength;
+        captureFilling = 1 - captureFilling;
+        captureLength = 0;
+        LeaveCriticalSection(&captureLock);
+        DWORD written;
+        if (length > 0 && !WriteFile(captureFile, buffer, length, &written, NULL)) {
+            logLastError("capture WriteFile");
+        }
+        if (stopping) return 0;
+        WaitForSingleObject(captureBell, 100);
+    }
+}
+
+static DWORD openCapture(const char* fileName) {
+    InitializeCriticalSection(&captureLock);
+    captureBuffers[0] = new BYTE[CAPTURE_BUFFER_SIZE];
+    captureBuffers[1] = new BYTE[CAPTURE_BUFFER_SIZE];
+    captureBell = CreateEvent(NULL, FALSE, FALSE, NULL);
+    captureFile = CreateFile(fileName, GENERIC_WRITE, FILE_SHARE_READ,
+                             NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (captureFile == INVALID_HANDLE_VALUE) return GetLastError();
+    // byte-order magic, version 1.0 and an unspecified section length:
+    DWORD body[4] = {0x1A2B3C4D, 1, 0xFFFFFFFF, 0xFFFFFFFF};
+    DWORD options[] = {4 | (8 << 16), 0, 0, 0}; // shb_userappl, opt_endofopt
+    memcpy(options + 1, "comProxy", 8);
+    captureBlock(PCAPNG_SECTION_HEADER, body, sizeof(body), NULL, 0, options, sizeof(options));
+    captureThread = CreateThread(NULL, 0, captureWriter, NULL, 0, NULL);
+    if (captureThread == NULL) return GetLastError();
+    return ERROR_SUCCESS;
+}
+
+/** Write the rest of the capture, and close the file. */
+static void closeCapture() {
+    if (captureThread != NULL) {
+        captureStopping = TRUE;
+        SetEvent(captureBell);
+        WaitForSingleObject(captureThread, INFINITE);
+        CloseHandle(captureThread);
+        captureThread = NULL;
+    }
+    if (captureFile != INVALID_HANDLE_VALUE) {
+        HANDLE file = captureFile;
+        captureFile = INVALID_HANDLE_VALUE;
+        CloseHandle(file);
+    }
+    if (captureDropped > 0) {
+        logInfo("capture dropped %d blocks", (int) captureDropped);
+    }
+}
+
+static LONG volatile tracePorts = 0;
+
+/** Give port a name in the flight recorder, the trace and the capture. */
+static void traceName(Port* port) {
+    captureInterfaces(port);
+    LONG index = InterlockedIncrement(&tracePorts) - 1;
+    if (index >= COM_PROXY_TRACE_MAX_PORTS) {
+        port->traceIndex = COM_PROXY_TRACE_MAX_PORTS; // unnamed
+        logInfo("%s is unnamed in the flight recorder and trace (more than %d ports)",
+                port->comName, COM_PROXY_TRACE_MAX_PORTS);
+        return;
+    }
+    port->traceIndex = (WORD) index;
+    flightPortNames[index] = port->comName;
+    if (traceHeader != NULL) {
+        strncpy(traceHeader->portNames[index], port->comName, COM_PROXY_TRACE_MAX_NAME - 1);
+        InterlockedExchange(&traceHeader->portCount, tracePorts);
+    }
+}
+
+/** Record an event (COM_PROXY_TRACE_*) in the flight recorder and the trace. */
+static void trace(Port* port, WORD event, DWORD a, DWORD b, DWORD c) {
+    LONGLONG time = microseconds();
+    DWORD position = (DWORD) InterlockedIncrement(&flightNext) - 1;
+    traceRecord(&flightRing[position & (FLIGHT_RING_SIZE - 1)], position, time,
+                port->traceIndex, event, a, b, c);
+    if (traceHeader == NULL) return;
+    position = (DWORD) InterlockedIncrement((LONG volatile*) &traceHeader->next) - 1;
+    traceRecord(&traceRecords[position % (DWORD) traceHeader->capacity], position, time,
+                port->traceIndex, event, a, b, c);
+}
+
+/** Retry comRx and comTx after port->retryDelay (unless a retry is already scheduled). */
+static void scheduleRetry(Port* port) {
+    if (port->retryDue == 0) port->retryDue = microseconds() + port->retryDelay;
+}
+
+/** Data were transferred, so retry promptly next time. */
+static void resetRetry(Port* port, BOOL* retried) {
+    if (*retried) {
+        *retried = FALSE;
+        ++port->retries;
+        logTrace("%s retry transferred data after %d usec", port->comName, (int) port->retryDelay);
+    }
+    port->retryDelay = RETRY_MIN;
+}
+
+static void rxFlush(Port* port);
+static void bondTx(Bond* bond);
+static void bondRx(Port* link);
+static void bondRxAll(Bond* bond);
+static void bondLinkFailed(Port* link);
+
+/** After the COM port is done, disconnect the pipe client when it has received all the data. */
+static void portFinish(Port* port) {
+    if (port->comDone && port->pipeName != NULL && port->clientConnected
+        && !port->clientWrite.pending && port->rxBuffer.hasData() <= 0) {
+        logInfo("%s disconnecting client", port->pipeName);
+        port->clientConnected = FALSE;
+        // This causes any pending pipe operation to complete:
+        if (!DisconnectNamedPipe(port->pipeHandle)) {
+            logLastError("DisconnectNamedPipe");
+        }
+    }
+}
+
+static void comFailed(Port* port, const char* from, DWORD err) {
+    if (!port->comDone) {
+        LPSTR message = errorMessage(err);
+        logInfo("%s %s error %d %s", port->comName, from, err, (message == NULL) ? "" : message);
+        if (message != NULL) LocalFree(message);
+        port->comDone = TRUE;
+        trace(port, COM_PROXY_TRACE_FAILED, err, 0, 0);
+        if (err != ERROR_SUCCESS && err != ERROR_OPERATION_ABORTED && err != ERROR_HANDLE_EOF) {
+            flightDump("COM port failed");
+        }
+        rxFlush(port);
+        if (port->comHandle != INVALID_HANDLE_VALUE) {
+            // Cause the pending COM operations to complete:
+            PurgeComm(port->comHandle, PURGE_TXABORT | PURGE_RXABORT);
+            SetCommMask(port->comHandle, 0);
+        }
+        portFinish(port);
+        if (port->bond != NULL) bondLinkFailed(port);
+    }
+}
+
+static void comRxDone(Port* port, DWORD err, DWORD count);
+static void comTxDone(Port* port, DWORD err, DWORD count);
+static void comEventDone(Port* port, DWORD err, DWORD count);
+static void clientWrite(Port* port);
+static void clientRead(Port* port);
+static void keepBacklog(Port* port);
+static void comReadDone(Port* port, DWORD err, DWORD count);
+
+/** Add the held bytes to rxBuffer, and pass them to the client. */
+static void rxFlush(Port* port) {
+    port->rxFlushDue = 0;
+    if (port->rxHeld > 0) {
+        port->rxBuffer.addData(port->rxHeld);
+        port->rxHeld = 0;
+        if (port->clientConnected) {
+            clientWrite(port);
+        } else {
+            keepBacklog(port);
+        }
+    }
+}
+
+/** Set *space to where data from the COM port should go (following the held
+    bytes) and return how many bytes may go there.
+ */
+static DWORD rxSpace(Port* port, BYTE** space) {
+    DWORD room = port->rxBuffer.hasSpace();
+    if (room <= port->rxHeld) {
+        // The held bytes fill the contiguous space.
+        rxFlush(port);
+        room = port->rxBuffer.hasSpace();
+    }
+    *space = port->rxBuffer.space() + port->rxHeld;
+    return room - port->rxHeld;
+}
+
+/** Stop or resume the other end's transmission, according to how full rxBuffer is. */
+static void rxFlow(Port* port) {
+    if (rxFlowControl == RX_FLOW_NONE || port->comDone || port->comHandle == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    DWORD capacity = port->rxBuffer.capacity();
+    DWORD high = (rxFlowHigh > 0 && rxFlowHigh <= capacity) ? rxFlowHigh : (capacity * 3 / 4);
+    DWORD low = (rxFlowLow > 0 && rxFlowLow < high) ? rxFlowLow : (capacity / 4);
+    DWORD occupied = port->rxBuffer.dataTotal() + port->rxHeld;
+    BOOL stop;
+    if (!port->rxFlowStopped && occupied >= high) {
+        stop = TRUE;
+    } else if (port->rxFlowStopped && occupied <= low) {
+        stop = FALSE;
+    } else {
+        // A shared memory client rings spaceBell only when asked.
+        if (port->rxFlowStopped) port->rxBuffer.awaitSpace();
+        return;
+    }
+    BOOL done = (rxFlowControl == RX_FLOW_RTS)
+        ? EscapeCommFunction(port->comHandle, stop ? CLRRTS : SETRTS)
+        : TransmitCommChar(port->comHandle, stop ? XOFF_CHAR : XON_CHAR);
+    if (!done) {
+        logLastError(rxFlowControl == RX_FLOW_RTS ? "EscapeCommFunction" : "TransmitCommChar");
+        scheduleRetry(port);
+        return;
+    }
+    logDebug("%s rx flow %s at %d bytes", port->comName, stop ? "stopped" : "resumed", occupied);
+    port->rxFlowStopped = stop;
+    if (stop) {
+        ++port->rxFlowStops;
+        port->rxBuffer.awaitSpace();
+    }
+}
+
+static const int LATENCY_BUCKETS = 21; // bucket b counts latencies < 2^b microseconds
+static LONG volatile latencyHistogram[LATENCY_BUCKETS] = {0}; // from postOperation to the engine
+static LONG volatile rxLatencyHistogram[LATENCY_BUCKETS] = {0}; // from a COM read to the client
+
+static void recordLatency(LONG volatile* histogram, LONGLONG latency) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && latency >= (((LONGLONG) 1) << bucket)) ++bucket;
+    InterlockedIncrement(&histogram[bucket]);
+}
+
+/** Note that count bytes were read from the COM port, now. They'll be added
+    to rxBuffer in the order they were read. If more than RX_ARRIVALS reads
+    are waiting for the client, the last one is extended instead, which
+    overstates the latency of the bytes added to it.
+ */
+static void rxArrived(Port* port, DWORD count) {
+    port->rxReceived += count;
+    if (port->rxArrivalCount >= RX_ARRIVALS) {
+        port->rxArrivals[(port->rxArrivalFirst + RX_ARRIVALS - 1) % RX_ARRIVALS].end = port->rxReceived;
+        return;
+    }
+    RxArrival* arrival = &port->rxArrivals[(port->rxArrivalFirst + port->rxArrivalCount) % RX_ARRIVALS];
+    arrival->end = port->rxReceived;
+    arrival->at = microseconds();
+    ++port->rxArrivalCount;
+}
+
+/** Forget the reads whose data have all been removed from rxBuffer. If the
+    client took them (rather than they were discarded), record their latency
+    from the COM port to the client in rxLatencyHistogram.
+ */
+static void rxTaken(Port* port, BOOL byClient) {
+    LONGLONG taken = port->rxBuffer.added - port->rxBuffer.dataTotal();
+    LONGLONG now = microseconds();
+    while (port->rxArrivalCount > 0) {
+        RxArrival* arrival = &port->rxArrivals[port->rxArrivalFirst];
+        if (arrival->end > taken) break;
+        if (byClient) recordLatency(rxLatencyHistogram, now - arrival->at);
+        port->rxArrivalFirst = (port->rxArrivalFirst + 1) % RX_ARRIVALS;
+        --port->rxArrivalCount;
+    }
+}
+
+/** Count bytes that were received into rxSpace. */
+static void rxAdd(Port* port, DWORD count) {
+    port->rxHeld += count;
+    if (port->rxGapMicroseconds <= 0 || (rxBatchBytes > 0 && port->rxHeld >= rxBatchBytes)) {
+        rxFlush(port);
+    } else {
+        port->rxFlushDue = microseconds() + port->rxGapMicroseconds;
+    }
+    rxFlow(port);
+}
+
+/** Count the line errors since the last call, and return the number of bytes
+    in the driver's input buffer (or MAXDWORD if that's unknown).
+ */
+static DWORD comStatus(Port* port) {
+    DWORD errors = 0;
+    COMSTAT status = {0};
+    if (!ClearCommError(port->comHandle, &errors, &status)) {
+        logLastError("ClearCommError");
+        return MAXDWORD;
+    }
+    if (errors != 0) {
+        logDebug("%s line errors%s%s%s%s%s", port->comName,
+                 (errors & CE_FRAME) ? " FRAME" : "",
+                 (errors & CE_OVERRUN) ? " OVERRUN" : "",
+                 (errors & CE_RXOVER) ? " RXOVER" : "",
+                 (errors & CE_RXPARITY) ? " RXPARITY" : "",
+                 (errors & CE_BREAK) ? " BREAK" : "");
+        if (errors & CE_FRAME) ++port->frameErrors;
+        if (errors & CE_OVERRUN) ++port->overrunErrors;
+        if (errors & CE_RXOVER) ++port->rxOverErrors;
+        if (errors & CE_RXPARITY) ++port->parityErrors;
+        if (errors & CE_BREAK) ++port->breaks;
+    }
+    trace(port, COM_PROXY_TRACE_COM_STATUS, errors, status.cbInQue, status.cbOutQue);
+    if (status.cbInQue > port->rxQueueMax) port->rxQueueMax = status.cbInQue;
+    return status.cbInQue;
+}
+
+/** Copy data from the posted reads to rxBuffer, in the order they were
+    posted, and post them again. Stop when the oldest read is still in
+    progress, or rxBuffer is full.
+ */
+static void comRxPosted(Port* port) {
+    port->rxStalled = FALSE;
+    while (!port->comDone) {
+        RxRead* read = &port->rxReads[port->rxReadNext];
+        if (read->reading) break; // It hasn't completed yet.
+        while (read->full && read->copied < read->count) {
+            BYTE* space;
+            DWORD toAdd = rxSpace(port, &space);
+            if (toAdd <= 0 && port->rxBuffer.awaitSpace()) {
+                toAdd = rxSpace(port, &space);
+            }
+            if (toAdd <= 0) {
+                if (!port->rxStalled) ++port->counters.rxStalls;
+                port->rxStalled = TRUE;
+                break;
+            }
+            if (toAdd > read->count - read->copied) toAdd = read->count - read->copied;
+            memmove(space, read->data + read->copied, toAdd);
+            read->copied += toAdd;
+            rxAdd(port, toAdd);
+        }
+        if (port->rxStalled) break;
+        read->full = FALSE;
+        read->count = 0;
+        read->copied = 0;
+        LPOVERLAPPED overlapped = startOperation(&read->op, port, comReadDone);
+        DWORD err = startedOperation
+            (&read->op, ReadFile(port->comHandle, read->data, RX_READ_SIZE, NULL, overlapped));
+        if (err != ERROR_SUCCESS) {
+            comFailed(port, "comRx ReadFile", err);
+            break;
+        }
+        ++port->counters.reads;
+        trace(port, COM_PROXY_TRACE_RX_START, RX_READ_SIZE, 0, 0);
+        read->reading = TRUE;
+        port->rxReadNext = (port->rxReadNext + 1) % rxReadCount;
+    }
+}
+
+/** Remove out-of-band bytes and escapes (see oobEscape) from count bytes of
+    data from the client, and queue the out-of-band bytes to be sent.
+    Return the number of bytes that remain.
+ */
+static DWORD takeOob(Port* port, BYTE* data, DWORD count) {
+    DWORD kept = 0;
+    for (DWORD d = 0; d < count; ++d) {
+        BYTE b = data[d];
+        if (port->oobEscaped) {
+            port->oobEscaped = FALSE;
+            if (b != oobEscape) {
+                if (port->oobCount >= OOB_MAX) {
+                    logInfo("%s dropped out-of-band %02X", port->comName, b);
+                    ++port->oobDropped;
+                } else {
+                    port->oobBytes[port->oobCount] = b;
+                    port->oobSince[port->oobCount] = microseconds();
+                    ++port->oobCount;
+                }
+                continue;
+            }
+        } else if (b == oobEscape) {
+            port->oobEscaped = TRUE;
+            continue;
+        }
+        data[kept++] = b;
+    }
+    return kept;
+}
+
+/** Send the queued out-of-band bytes, ahead of the data in txBuffer. */
+static void comOob(Port* port) {
+    HANDLE comHandle = port->comHandle;
+    if (port->bond != NULL && port->bondLink < 0) {
+        // Send them through any link.
+        comHandle = INVALID_HANDLE_VALUE;
+        for (int l = 0; l < port->bond->linkCount; ++l) {
+            Port* link = port->bond->links[l].port;
+            if (!link->comDone) {
+                comHandle = link->comHandle;
+                break;
+            }
+        }
+    } else if (port->comDone) {
+        return;
+    }
+    while (port->oobCount > 0 && comHandle != INVALID_HANDLE_VALUE) {
+        if (!TransmitCommChar(comHandle, (char) port->oobBytes[0])) {
+            // Perhaps the previous one hasn't been transmitted yet.
+            logLastError("TransmitCommChar");
+            scheduleRetry(port);
+            return;
+        }
+        captureData(port, CAPTURE_OUTBOUND, port->oobBytes, 1);
+        LONGLONG latency = microseconds() - port->oobSince[0];
+        logDebug("%s out-of-band %02X after %d usec", port->comName, port->oobBytes[0], (int) latency);
+        ++port->oobSent;
+        port->oobLatencyTotal += latency;
+        if (latency > port->oobLatencyMax) port->oobLatencyMax = latency;
+        --port->oobCount;
+        memmove(port->oobBytes, port->oobBytes + 1, port->oobCount);
+        memmove(port->oobSince, port->oobSince + 1, port->oobCount * sizeof(LONGLONG));
+    }
+}
+
+static void oobSendDone(Port* port, DWORD err, DWORD count) {
+    comOob(port);
+}
+
+/* With --replay=<capture file>[,<speed>], comProxy doesn't open the COM
+   port, but replays the data received from it in a capture (see
+   --capture). So a client can be tested with real traffic, repeatably.
+   A replayer thread reads the capture, and waits until the original time
+   of each packet (relative to the first) divided by speed, or doesn't
+   wait if speed is zero. Then it posts replay->arrived, and comRx copies
+   the data into rxBuffer and completes port->comRx, as if ReadFile had
+   read them. Data written to the COM port are discarded: comTx completes
+   port->comTx without writing. After the last packet the COM port fails
+   with ERROR_HANDLE_EOF, which ends comProxy as usual.
+ */
+struct Replay {
+    const char* fileName;
+    FILE* file = NULL;
+    double speed; // zero indicates as fast as possible
+    DWORD dataInterface = 0xFFFFFFFF; // the interface whose packets are replayed
+    double ticksPerSecond = 1000000; // of its timestamps
+    Port* port = NULL;
+    Operation arrived = {0}; // posted by the replayer after it sets ready
+    HANDLE consumed = NULL; // rung by comRx after it clears ready
+    HANDLE stop = NULL; // set by replayStop
+    HANDLE thread = NULL; // the replayer
+    BYTE* data = NULL; // received from the COM port
+    DWORD dataSize = 0;
+    DWORD length = 0; // of data
+    DWORD offset = 0; // the next byte for rxBuffer
+    LONG volatile ready = FALSE; // data are waiting for comRx
+    LONG volatile ended = FALSE; // there are no more data
+
+    Replay(const char* fileName, double speed)
+        : fileName(fileName), speed(speed) {}
+};
+
+/** Read the next pcapng block from file, into *block (which holds *size
+    bytes, and is enlarged as needed). Set *length to the length of the
+    block's body. Return the block type, or zero at the end of the file.
+ */
+static DWORD replayBlock(FILE* file, BYTE** block, DWORD* size, DWORD* length) {
+    DWORD header[2]; // type and total length
+    if (fread(header, sizeof(header), 1, file) != 1) return 0;
+    if (header[1] < 12 || header[1] > (64 << 20) || (header[1] & 3) != 0) {
+        logInfo("replay malformed block %08X length %d", header[0], header[1]);
+        return 0;
+    }
+    *length = header[1] - 12;
+    if (*size < *length + 4) {
+        delete[] *block;
+        *size = *length + 4;
+        *block = new BYTE[*size];
+    }
+    if (fread(*block, *length + 4, 1, file) != 1) return 0; // the body and the total length
+    return header[0];
+}
+
+/** Return the value of the first option with code in the options that follow body[offset]. */
+static BYTE* replayOption(BYTE* body, DWORD length, DWORD offset, WORD code, WORD* optionLength) {
+    while (offset + 4 <= length) {
+        WORD header[2]; // code and length
+        memcpy(header, body + offset, 4);
+        if (header[0] == 0) break; // opt_endofopt
+        if (offset + 4 + header[1] > length) break;
+        if (header[0] == code) {
+            *optionLength = header[1];
+            return body + offset + 4;
+        }
+        offset += 4 + ((header[1] + 3) & ~3);
+    }
+    return NULL;
+}
+
+/** Choose the interface whose packets to replay: the data interface named
+    like the port if there is one, or else the first data interface.
+    Return an error code.
+ */
+static DWORD replayChoose(Replay* replay) {
+    BYTE* block = NULL;
+    DWORD size = 0, length;
+    DWORD type;
+    DWORD interfaces = 0;
+    BOOL named = FALSE;
+    while ((type = replayBlock(replay->file, &block, &size, &length)) != 0) {
+        if (type == PCAPNG_SECTION_HEADER) {
+            DWORD magic;
+            memcpy(&magic, block, 4);
+            if (length < 16 || magic != 0x1A2B3C4D) break; // Other byte orders aren't supported.
+            interfaces = 0;
+        } else if (type == PCAPNG_INTERFACE && length >= 8) {
+            WORD linkType;
+            memcpy(&linkType, block, 2);
+            DWORD interfaceId = interfaces++;
+            if (linkType != LINKTYPE_USER0 || named) continue;
+            WORD nameLength = 0;
+            const BYTE* name = replayOption(block, length, 8, 2, &nameLength); // if_name
+            named = (name != NULL && nameLength == strlen(replay->port->comName)
+                     && _strnicmp((const char*) name, replay->port->comName, nameLength) == 0);
+            if (!named && replay->dataInterface != 0xFFFFFFFF) continue;
+            replay->dataInterface = interfaceId;
+            WORD resolutionLength = 0;
+            const BYTE* resolution = replayOption(block, length, 8, 9, &resolutionLength); // if_tsresol
+            replay->ticksPerSecond = 1000000;
+            if (resolution != NULL && resolutionLength == 1) {
+                // a negative power of 2 or 10
+                replay->ticksPerSecond = 1;
+                for (int r = 0; r < (*resolution & 0x7F); ++r) {
+                    replay->ticksPerSecond *= (*resolution & 0x80) ? 2 : 10;
+                }
+            }
+        }
+    }
+    delete[] block;
+    rewind(replay->file);
+    return (replay->dataInterface == 0xFFFFFFFF) ? ERROR_NOT_FOUND : ERROR_SUCCESS;
+}
+
+/** Wait until due (a time from microseconds()). */
+static BOOL replayWait(Replay* replay, LONGLONG due) {
+    while (TRUE) {
+        LONGLONG wait = due - microseconds();
+        if (wait <= 0) return TRUE;
+        if (wait > 2000) {
+            // which may oversleep by a millisecond:
+            if (WaitForSingleObject(replay->stop, (DWORD) (wait / 1000) - 1) == WAIT_OBJECT_0) return FALSE;
+        } else {
+            SwitchToThread();
+        }
+    }
+}
+
+/** Wait for comRx to take the previous packet. Return FALSE if replayStop was called. */
+static BOOL replayAwaitConsumed(Replay* replay) {
+    HANDLE events[2] = {replay->consumed, replay->stop};
+    while (replay->ready) {
+        if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0) return FALSE;
+    }
+    return TRUE;
+}
+
+static DWORD WINAPI replayer(LPVOID parameter) {
+    Replay* replay = (Replay*) parameter;
+    BYTE* block = NULL;
+    DWORD size = 0, length;
+    DWORD type;
+    LONGLONG start = microseconds();
+    double first = -1; // time of the first packet, in seconds
+    BOOL stopped = FALSE;
+    while (!stopped && (type = replayBlock(replay->file, &block, &size, &length)) != 0) {
+        if (type != PCAPNG_PACKET || length < 20) continue;
+        DWORD packet[5]; // interface, timestamp (high), timestamp (low), captured and original length
+        memcpy(packet, block, sizeof(packet));
+        DWORD captured = packet[3];
+        if (packet[0] != replay->dataInterface || captured <= 0 || 20 + captured > length) continue;
+        WORD flagsLength = 0;
+        const BYTE* flags = replayOption(block, length, 20 + ((captured + 3) & ~3), 2, &flagsLength);
+        if (flags != NULL && flagsLength == 4 && (*flags & 3) != CAPTURE_INBOUND) continue;
+        double time = ((((ULONGLONG) packet[1]) << 32) | packet[2]) / replay->ticksPerSecond;
+        if (first < 0) first = time;
+        if (!replayAwaitConsumed(replay)
+            || (replay->speed > 0
+                && !replayWait(replay, start + (LONGLONG) ((time - first) * 1000000 / replay->speed)))) {
+            stopped = TRUE;
+            break;
+        }
+        if (replay->dataSize < captured) {
+            delete[] replay->data;
+            replay->dataSize = captured;
+            replay->data = new BYTE[captured];
+        }
+        memcpy(replay->data, block + 20, captured);
+        replay->length = captured;
+        replay->offset = 0;
+        InterlockedExchange(&replay->ready, TRUE);
+        postOperation(&replay->arrived);
+    }
+    if (!stopped && replayAwaitConsumed(replay)) {
+        logInfo("%s replayed %s", replay->port->comName, replay->fileName);
+        InterlockedExchange(&replay->ended, TRUE);
+        postOperation(&replay->arrived);
+    }
+    delete[] block;
+    return 0;
+}
+
+static void comRx(Port* port);
+
+static void replayArrived(Port* port, DWORD err, DWORD count) {
+    comRx(port);
+}
+
+/** Open the capture and start replaying it to port. Return an error code. */
+static DWORD replayStart(Port* port) {
+    Replay* replay = port->replay;
+    replay->port = port;
+    replay->file = fopen(replay->fileName, "rb");
+    if (replay->file == NULL) return ERROR_FILE_NOT_FOUND;
+    DWORD err = replayChoose(replay);
+    if (err != ERROR_SUCCESS) return err;
+    replay->consumed = CreateEvent(NULL, FALSE, FALSE, NULL);
+    replay->stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    startOperation(&replay->arrived, port, replayArrived);
+    replay->thread = CreateThread(NULL, 0, replayer, replay, 0, NULL);
+    if (replay->thread == NULL) return GetLastError();
+    return ERROR_SUCCESS;
+}
+
+/** Stop the replayer, and wait for it to finish. */
+static void replayStop(Replay* replay) {
+    if (replay->thread == NULL) return;
+    SetEvent(replay->stop);
+    WaitForSingleObject(replay->thread, INFINITE);
+    CloseHandle(replay->thread);
+    replay->thread = NULL;
+}
+
+/** Complete op as if the COM port had transferred count bytes.
+    Return the error code, or ERROR_SUCCESS if a completion packet will be queued.
+ */
+static DWORD replayComplete(Operation* op, DWORD count) {
+    DWORD err = completions.post(op, count);
+    if (err == ERROR_SUCCESS) op->pending = TRUE;
+    return err;
+}
+
+/** Copy replayed data into space, as comRx would read them from the COM port. */
+static void replayRx(Port* port, BYTE* space, DWORD toRead) {
+    Replay* replay = port->replay;
+    if (!replay->ready) {
+        // replayer will post replay->arrived when it has more.
+        if (replay->ended) comFailed(port, "replay", ERROR_HANDLE_EOF);
+        return;
+    }
+    DWORD count = replay->length - replay->offset;
+    if (count > toRead) count = toRead;
+    memcpy(space, replay->data + replay->offset, count);
+    replay->offset += count;
+    if (replay->offset >= replay->length) {
+        InterlockedExchange(&replay->ready, FALSE);
+        SetEvent(replay->consumed);
+    }
+    startOperation(&port->comRx, port, comRxDone);
+    DWORD err = replayComplete(&port->comRx, count);
+    trace(port, COM_PROXY_TRACE_RX_START, count, 0, 0);
+    if (err != ERROR_SUCCESS) comFailed(port, "replay PostQueuedCompletionStatus", err);
+}
+
+/** Start reading from the COM port, if possible. */
+static void comRx(Port* port) {
+    if (port->bond != NULL && port->bondLink < 0) {
+        // The bond's client receives from all the links.
+        port->rxStalled = FALSE;
+        bondRxAll(port->bond);
+        return;
+    }
+    if (port->rxReads != NULL) {
+        comRxPosted(port);
+        return;
+    }
+    if (port->comDone || port->comRx.pending) return;
+    BYTE* space;
+    DWORD toRead = rxSpace(port, &space);
+    if (toRead <= 0 && port->rxBuffer.awaitSpace()) {
+        toRead = rxSpace(port, &space);
+    }
+    if (toRead <= 0) {
+        if (!port->rxStalled) ++port->counters.rxStalls;
+        port->rxStalled = TRUE;
+        return;
+    }
+    port->rxStalled = FALSE;
+    if (port->replay != NULL) {
+        replayRx(port, space, toRead);
+        return;
+    }
+    // Read only what the driver has, rather than reading zero bytes:
+    DWORD queued = comStatus(port);
+    if (queued <= 0) {
+        port->rxRetried = FALSE;
+        scheduleRetry(port); // in case no EV_RXCHAR follows
+        return;
+    }
+    if (toRead > queued) toRead = queued;
+    LPOVERLAPPED overlapped = startOperation(&port->comRx, port, comRxDone);
+    DWORD err = startedOperation
+        (&port->comRx, ReadFile(port->comHandle, space, toRead, NULL, overlapped));
+    logIOResult("comRx ReadFile", err, toRead);
+    ++port->counters.reads;
+    trace(port, COM_PROXY_TRACE_RX_START, toRead, 0, 0);
+    if (err != ERROR_SUCCESS) comFailed(port, "comRx ReadFile", err);
+}
+
+/** Record how long the line was idle while data were waiting to be written. */
+static void txGap(Port* port) {
+    if (port->txIdleSince != 0) {
+        LONGLONG gap = microseconds() - port->txIdleSince;
+        port->txIdleSince = 0;
+        ++port->txGaps;
+        port->txGapTotal += gap;
+        if (gap > port->txGapMax) port->txGapMax = gap;
+    }
+}
+
+static void comWriteDone(Port* port, DWORD err, DWORD count);
+
+/** Return FALSE if comTx should wait for more data (see txCoalesceMicroseconds). */
+static BOOL txReady(Port* port) {
+    if (txCoalesceMicroseconds <= 0) return TRUE;
+    DWORD waiting = port->txBuffer.dataTotal() - port->txInFlight;
+    if (waiting <= 0) return TRUE; // comTx will find nothing to write.
+    if ((txCoalesceBytes > 0 && waiting >= txCoalesceBytes) || port->txBuffer.spaceTotal() <= 0) {
+        return TRUE;
+    }
+    if (txDelimiter >= 0) {
+        for (DWORD offset = port->txInFlight; offset < port->txInFlight + waiting; ) {
+            DWORD length = 0;
+            BYTE* data = port->txBuffer.dataAfter(offset, &length);
+            if (length <= 0) break;
+            if (memchr(data, txDelimiter, length) != NULL) return TRUE;
+            offset += length;
+        }
+    }
+    LONGLONG now = microseconds();
+    if (port->txWaitingSince == 0) port->txWaitingSince = now;
+    if (now - port->txWaitingSince >= txCoalesceMicroseconds) return TRUE;
+    port->txFlushDue = port->txWaitingSince + txCoalesceMicroseconds;
+    return FALSE;
+}
+
+/** Start writes to the COM port, until txWriteCount are in flight or
+    there's no more data to write.
+ */
+static void comTxPipelined(Port* port) {
+    while (!port->comDone && !port->txRewinding && port->txWriting < txWriteCount) {
+        DWORD toWrite = 0;
+        BYTE* data = port->txBuffer.dataAfter(port->txInFlight, &toWrite);
+        if (toWrite <= 0 && port->txBuffer.awaitData()) {
+            data = port->txBuffer.dataAfter(port->txInFlight, &toWrite);
+        }
+        if (toWrite <= 0) {
+            if (port->txWriting <= 0 && port->txBuffer.isClosed()) stdinDone = TRUE;
+            return;
+        }
+        if (!txReady(port)) return;
+        DWORD modemStatus;
+        if (port->txWriting > 0 && port->comHandle != INVALID_HANDLE_VALUE
+            && GetCommModemStatus(port->comHandle, &modemStatus) && !(modemStatus & MS_CTS_ON)) {
+            return; // Pipeline after EV_CTS.
+        }
+        TxWrite* write = &port->txWrites[(port->txWriteNext + port->txWriting) % txWriteCount];
+        if (port->txWriting <= 0) txGap(port);
+        port->txWaitingSince = 0;
+        port->txFlushDue = 0;
+        LPOVERLAPPED overlapped = startOperation(&write->op, port, comWriteDone);
+        DWORD err = (port->replay != NULL) ? replayComplete(&write->op, toWrite)
+            : startedOperation(&write->op, WriteFile(port->comHandle, data, toWrite, NULL, overlapped));
+        logIOResult("comTx WriteFile", err, toWrite);
+        if (err != ERROR_SUCCESS) {
+            comFailed(port, "comTx WriteFile", err);
+            return;
+        }
+        ++port->counters.writes;
+        trace(port, COM_PROXY_TRACE_TX_START, toWrite, 0, 0);
+        write->writing = TRUE;
+        write->done = FALSE;
+        write->count = toWrite;
+        write->written = 0;
+        port->txInFlight += toWrite;
+        ++port->txWriting;
+    }
+}
+
+/** Start writing to the COM port, if possible. */
+static void comTx(Port* port) {
+    if (port->bond != NULL && port->bondLink < 0) {
+        // The bond's client transmits through all the links.
+        if (!port->comDone) bondTx(port->bond);
+        return;
+    }
+    if (port->txWrites != NULL) {
+        comTxPipelined(port);
+        return;
+    }
+    if (port->comDone || port->comTx.pending) return;
+    DWORD toWrite = port->txBuffer.hasData();
+    if (toWrite <= 0 && port->txBuffer.awaitData()) {
+        toWrite = port->txBuffer.hasData();
+    }
+    if (toWrite <= 0) {
+        if (port->txBuffer.isClosed()) stdinDone = TRUE;
+        return;
+    }
+    if (!txReady(port)) return;
+    txGap(port);
+    port->txWaitingSince = 0;
+    port->txFlushDue = 0;
+    LPOVERLAPPED overlapped = startOperation(&port->comTx, port, comTxDone);
+    DWORD err = (port->replay != NULL) ? replayComplete(&port->comTx, toWrite)
+        : startedOperation(&port->comTx, WriteFile(port->comHandle, port->txBuffer.data(), toWrite,
+                                                   NULL, overlapped));
+    logIOResult("comTx WriteFile", err, toWrite);
+    ++port->counters.writes;
+    trace(port, COM_PROXY_TRACE_TX_START, toWrite, 0, 0);
+    if (err != ERROR_SUCCESS) comFailed(port, "comTx WriteFile", err);
+}
+
+/** Start waiting for a COM event. */
+static void comEvent(Port* port) {
+    if (port->comDone || port->comEvent.pending || port->replay != NULL) return;
+    LPOVERLAPPED overlapped = startOperation(&port->comEvent, port, comEventDone);
+    DWORD err = startedOperation
+        (&port->comEvent, WaitCommEvent(port->comHandle, &port->comEventMask, overlapped));
+    if (err != ERROR_SUCCESS) comFailed(port, "comEvent WaitCommEvent", err);
+}
+
+static void comRxDone(Port* port, DWORD err, DWORD count) {
+    trace(port, COM_PROXY_TRACE_RX_DONE, err, count, port->rxBuffer.dataTotal());
+    if (err != ERROR_SUCCESS) {
+        comFailed(port, "comRx GetOverlappedResult", err);
+        return;
+    }
+    logDebug("%s comRx read %d %s", port->comName, count,
+             dump(port->rxBuffer.space() + port->rxHeld, count).text);
+    if (count > 0) captureData(port, CAPTURE_INBOUND, port->rxBuffer.space() + port->rxHeld, count);
+    port->counters.rxBytes += count;
+    if (count <= 0) ++port->counters.rxZero;
+    /* ReadFile indicates no input by reading zero bytes. To avoid
+       wasting time, comRx will be called after WaitCommEvent returns
+       EV_RXCHAR or after a delay, rather than immediately.
+     */
+    if (count <= 0) {
+        port->rxRetried = FALSE;
+        scheduleRetry(port);
+        return;
+    }
+    resetRetry(port, &port->rxRetried);
+    rxArrived(port, count);
+    rxAdd(port, count);
+    comRx(port); // until the COM port has no more data
+}
+
+/** One of the posted reads completed. */
+static void comReadDone(Port* port, DWORD err, DWORD count) {
+    // The engine cleared op.pending, so that's the read that completed:
+    RxRead* read = NULL;
+    for (int r = 0; r < rxReadCount; ++r) {
+        if (port->rxReads[r].reading && !port->rxReads[r].op.pending) {
+            read = &port->rxReads[r];
+            break;
+        }
+    }
+    if (read == NULL) return;
+    read->reading = FALSE;
+    trace(port, COM_PROXY_TRACE_RX_DONE, err, count, port->rxBuffer.dataTotal());
+    if (err != ERROR_SUCCESS) {
+        comFailed(port, "comRx GetOverlappedResult", err);
+        return;
+    }
+    logDebug("%s comRx read %d %s", port->comName, count, dump(read->data, count).text);
+    if (count > 0) captureData(port, CAPTURE_INBOUND, read->data, count);
+    port->counters.rxBytes += count;
+    if (count <= 0) ++port->counters.rxZero;
+    if (count > 0) rxArrived(port, count);
+    read->count = count;
+    read->full = TRUE;
+    comRxPosted(port);
+}
+
+static void comTxDone(Port* port, DWORD err, DWORD count) {
+    trace(port, COM_PROXY_TRACE_TX_DONE, err, count, port->txBuffer.dataTotal());
+    if (err != ERROR_SUCCESS) {
+        comFailed(port, "comTx GetOverlappedResult", err);
+        return;
+    }
+    logDebug("%s comTx wrote %d %s", port->comName, count, dump(port->txBuffer.data(), count).text);
+    if (count > 0) captureData(port, CAPTURE_OUTBOUND, port->txBuffer.data(), count);
+    port->counters.txBytes += count;
+    if (count <= 0) ++port->counters.txZero;
+    if (count <= 0) {
+        // comTx will be called after EV_TXEMPTY or EV_CTS, or after a delay.
+        port->txRetried = FALSE;
+        scheduleRetry(port);
+        return;
+    }
+    resetRetry(port, &port->txRetried);
+    port->txBuffer.removeData(count);
+    if (port->txBuffer.hasData() > 0) port->txIdleSince = microseconds();
+    if (port->txStalled) clientRead(port);
+    comTx(port);
+}
+
+/** One of the pipelined writes completed. */
+static void comWriteDone(Port* port, DWORD err, DWORD count) {
+    // The engine cleared op.pending, so that's the write that completed:
+    TxWrite* write = NULL;
+    for (int w = 0; w < txWriteCount; ++w) {
+        if (port->txWrites[w].writing && !port->txWrites[w].op.pending) {
+            write = &port->txWrites[w];
+            break;
+        }
+    }
+    if (write == NULL) return;
+    write->writing = FALSE;
+    trace(port, COM_PROXY_TRACE_TX_DONE, err, count, port->txBuffer.dataTotal());
+    if (err != ERROR_SUCCESS && !(err == ERROR_OPERATION_ABORTED && port->txRewinding)) {
+        comFailed(port, "comTx GetOverlappedResult", err);
+        return;
+    }
+    logDebug("%s comTx wrote %d of %d", port->comName, count, write->count);
+    port->counters.txBytes += count;
+    if (count <= 0) ++port->counters.txZero;
+    write->written = count;
+    write->done = TRUE;
+    // Remove the data that were written, in the order the writes started:
+    BOOL removed = FALSE;
+    while (port->txWriting > 0) {
+        write = &port->txWrites[port->txWriteNext];
+        if (!write->done) break;
+        write->done = FALSE;
+        port->txWriteNext = (port->txWriteNext + 1) % txWriteCount;
+        --port->txWriting;
+        port->txInFlight -= write->count;
+        DWORD toRemove = write->written;
+        if (port->txRewinding) {
+            // An earlier write was short, so this write's data will be written again.
+            if (write->written > 0) {
+                // They followed the hole on the line, so the data are corrupt.
+                logInfo("%s comTx canceled write had written %d bytes after a short write",
+                        port->comName, write->written);
+                comFailed(port, "comTx pipelined write", ERROR_WRITE_FAULT);
+                return;
+            }
+            toRemove = 0;
+        } else {
+            // This write's data are first in txBuffer:
+            if (write->written > 0) captureData(port, CAPTURE_OUTBOUND, port->txBuffer.data(), write->written);
+            if (write->written < write->count) {
+                if (port->txWriting > 0) {
+                    logInfo("%s comTx wrote %d of %d; canceling later writes",
+                            port->comName, write->written, write->count);
+                    port->txRewinding = TRUE;
+                    ++port->txRewinds;
+                    if (port->comHandle != INVALID_HANDLE_VALUE
+                        && !PurgeComm(port->comHandle, PURGE_TXABORT)) {
+                        logLastError("PurgeComm");
+                    }
+                } else {
+                    scheduleRetry(port); // Try the rest again later.
+                }
+            }
+        }
+        if (toRemove > 0) {
+            port->txBuffer.removeData(toRemove);
+            removed = TRUE;
+        }
+    }
+    if (port->txRewinding && port->txWriting <= 0) {
+        port->txRewinding = FALSE; // comTx writes from the first byte that wasn't written.
+    }
+    if (removed) {
+        resetRetry(port, &port->txRetried);
+        if (port->txWriting <= 0 && port->txBuffer.hasData() > 0) port->txIdleSince = microseconds();
+        if (port->txStalled) clientRead(port);
+    } else {
+        port->txRetried = FALSE;
+    }
+    comTx(port);
+}
+
+static void comEventDone(Port* port, DWORD err, DWORD count) {
+    trace(port, COM_PROXY_TRACE_COM_EVENT, err, port->comEventMask, 0);
+    if (err != ERROR_SUCCESS) {
+        comFailed(port, "comEvent GetOverlappedResult", err);
+        return;
+    }
+    DWORD mask = port->comEventMask;
+    logTrace("%s comEvent%s%s%s%s%s%s%s%s%s", port->comName,
+             (mask & EV_RXCHAR) ? " RXCHAR" : "",
+             (mask & EV_TXEMPTY) ? " TXEMPTY" : "",
+             (mask & EV_CTS) ? " CTS" : "",
+             (mask & EV_DSR) ? " DSR" : "",
+             (mask & EV_RLSD) ? " RLSD" : "",
+             (mask & EV_BREAK) ? " BREAK" : "",
+             (mask & EV_RXFLAG) ? " RXFLAG" : "",
+             (mask & EV_ERR) ? " ERR" : "",
+             (mask & EV_RING) ? " RING" : "");
+    captureEvent(port, mask);
+    for (int b = 0; b < COM_EVENT_BITS; ++b) {
+        if (mask & (1 << b)) ++port->counters.comEvents[b];
+    }
+    if (mask & EV_ERR) {
+        comStatus(port); // Count the errors.
+    }
+    if (mask & EV_RXCHAR) {
+        comRx(port);
+    }
+    if (mask & (EV_TXEMPTY | EV_CTS)) {
+        comTx(port);
+    }
+    comEvent(port);
+}
+
+static void pipeConnectDone(Port* port, DWORD err, DWORD count);
+static void pipeReadDone(Port* port, DWORD err, DWORD count);
+static void pipeWriteDone(Port* port, DWORD err, DWORD count);
+
+/** Start waiting for a client to connect to the pipe. */
+static void pipeConnect(Port* port) {
+    if (port->comDone || port->clientConnect.pending) return;
+    LPOVERLAPPED overlapped = startOperation(&port->clientConnect, port, pipeConnectDone);
+    DWORD err = ConnectNamedPipe(port->pipeHandle, overlapped) ? ERROR_SUCCESS : GetLastError();
+    switch (err) {
+    case ERROR_SUCCESS:
+    case ERROR_IO_PENDING:
+        port->clientConnect.pending = TRUE;
+        break;
+    case ERROR_PIPE_CONNECTED:
+        // A client connected before we called ConnectNamedPipe. No packet is queued.
+        pipeConnectDone(port, ERROR_SUCCESS, 0);
+        break;
+    default:
+        comFailed(port, "ConnectNamedPipe", err);
+    }
+}
+
+/** Start reading from the client, if possible. */
+static void clientRead(Port* port) {
+    if (port->bond != NULL && port->bondLink >= 0) {
+        port->txStalled = FALSE;
+        bondTx(port->bond); // more fragments for this link
+        return;
+    }
+    // stdinReader reads whenever txBuffer has space.
+    if (port->pipeName == NULL) return;
+    if (!port->clientConnected || port->clientRead.pending) return;
+    DWORD toRead = port->txBuffer.hasSpace();
+    if (toRead <= 0) {
+        if (!port->txStalled) ++port->counters.txStalls;
+        port->txStalled = TRUE;
+        return;
+    }
+    port->txStalled = FALSE;
+    LPOVERLAPPED overlapped = startOperation(&port->clientRead, port, pipeReadDone);
+    DWORD err = startedOperation
+        (&port->clientRead, ReadFile(port->pipeHandle, port->txBuffer.space(), toRead, NULL, overlapped));
+    if (err != ERROR_SUCCESS) pipeReadDone(port, err, 0);
+}
+
+/** Start writing to the client, if possible. */
+static void clientWrite(Port* port) {
+    if (port->bond != NULL && port->bondLink >= 0) {
+        bondRx(port); // fragments from this link
+        return;
+    }
+    // stdoutWriter writes whenever rxBuffer has data.
+    if (port->pipeName == NULL) return;
+    if (!port->clientConnected || port->clientWrite.pending) return;
+    DWORD toWrite = port->rxBuffer.hasData();
+    if (toWrite <= 0) return;
+    LPOVERLAPPED overlapped = startOperation(&port->clientWrite, port, pipeWriteDone);
+    DWORD err = startedOperation
+        (&port->clientWrite, WriteFile(port->pipeHandle, port->rxBuffer.data(), toWrite, NULL, overlapped));
+    if (err != ERROR_SUCCESS) pipeWriteDone(port, err, 0);
+}
+
+/** Discard data from the COM port, which no client will receive. */
+static void discardRx(Port* port) {
+    DWORD discarded = 0;
+    DWORD toRemove;
+    while ((toRemove = port->rxBuffer.hasData()) > 0) {
+        port->rxBuffer.removeData(toRemove);
+        discarded += toRemove;
+    }
+    if (discarded > 0) logDebug("%s discarded %d", port->comName, discarded);
+    rxTaken(port, FALSE);
+    rxFlow(port);
+    if (port->rxStalled) comRx(port);
+}
+
+/** While no client is connected, keep the newest data from the COM port
+    for the next client, up to backlogSize bytes. Discard older data. */
+static void keepBacklog(Port* port) {
+    if (backlogSize <= 0) {
+        discardRx(port);
+    } else if (port->rxBuffer.hasSpace() <= 0) {
+        DWORD toRemove = port->rxBuffer.hasData();
+        port->rxBuffer.removeData(toRemove);
+        logDebug("%s discarded %d", port->comName, toRemove);
+        rxTaken(port, FALSE);
+    }
+}
+
+/** Disconnect the pipe client, and wait for another client after the
+    pending pipe operations complete. */
+static void pipeClientGone(Port* port, const char* from, DWORD err) {
+    if (port->clientConnected) {
+        logError(from, err);
+        logInfo("%s client disconnected", port->pipeName);
+        port->clientConnected = FALSE;
+        // Cause any other pending pipe operation to complete:
+        if (!DisconnectNamedPipe(port->pipeHandle)) {
+            logLastError("DisconnectNamedPipe");
+        }
+    }
+    if (!port->clientRead.pending && !port->clientWrite.pending) {
+        keepBacklog(port);
+        pipeConnect(port);
+    }
+}
+
+static void pipeConnectDone(Port* port, DWORD err, DWORD count) {
+    if (err != ERROR_SUCCESS) {
+        comFailed(port, "ConnectNamedPipe", err);
+        return;
+    }
+    logInfo("%s client connected", port->pipeName);
+    port->clientConnected = TRUE;
+    if (port->comDone) {
+        port->clientConnected = FALSE;
+        DisconnectNamedPipe(port->pipeHandle);
+        return;
+    }
+    clientRead(port);
+    clientWrite(port);
+}
+
+static void pipeReadDone(Port* port, DWORD err, DWORD count) {
+    if (err != ERROR_SUCCESS || !port->clientConnected) {
+        pipeClientGone(port, "pipe ReadFile", err);
+        return;
+    }
+    logDebug("%s read %d %s", port->pipeName, count, dump(port->txBuffer.space(), count).text);
+    if (oobEscape >= 0) {
+        count = takeOob(port, port->txBuffer.space(), count);
+        comOob(port);
+    }
+    port->txBuffer.addData(count);
+    trace(port, COM_PROXY_TRACE_CLIENT_TX, 0, 0, port->txBuffer.dataTotal());
+    comTx(port);
+    clientRead(port);
+}
+
+static void pipeWriteDone(Port* port, DWORD err, DWORD count) {
+    if (err != ERROR_SUCCESS || !port->clientConnected) {
+        pipeClientGone(port, "pipe WriteFile", err);
+        return;
+    }
+    logDebug("%s wrote %d %s", port->pipeName, count, dump(port->rxBuffer.data(), count).text);
+    port->rxBuffer.removeData(count);
+    trace(port, COM_PROXY_TRACE_CLIENT_RX, 0, 0, port->rxBuffer.dataTotal());
+    rxTaken(port, TRUE);
+    rxFlow(port);
+    if (port->rxStalled) comRx(port);
+    clientWrite(port);
+    portFinish(port);
+}
+
+/** stdinReader or the parent process added data to txBuffer. */
+static void txBufferAdded(Port* port, DWORD err, DWORD count) {
+    trace(port, COM_PROXY_TRACE_CLIENT_TX, 0, 0, port->txBuffer.dataTotal());
+    comTx(port);
+}
+
+/** stdoutWriter or the parent process removed data from rxBuffer. */
+static void rxBufferRemoved(Port* port, DWORD err, DWORD count) {
+    trace(port, COM_PROXY_TRACE_CLIENT_RX, 0, 0, port->rxBuffer.dataTotal());
+    rxTaken(port, TRUE); // including the latency from postOperation
+    rxFlow(port);
+    if (port->rxStalled) comRx(port);
+}
+
+/* Options that reduce the effect of other processes on latency:
+   --priority sets the process priority class; --engine-thread,
+   --stdin-thread and --stdout-thread set a thread priority and the CPU
+   on which threads of that kind run; and --lock-memory keeps the buffers
+   in RAM (not paged out).
+ */
+struct ThreadOptions {
+    const char* name;
+    BOOL setPriority;
+    int priority; // THREAD_PRIORITY_*
+    int cpu; // or -1
+};
+static ThreadOptions engineThreadOptions = {"engine", FALSE, THREAD_PRIORITY_NORMAL, -1};
+static ThreadOptions stdinThreadOptions = {"stdin", FALSE, THREAD_PRIORITY_NORMAL, -1};
+static ThreadOptions stdoutThreadOptions = {"stdout", FALSE, THREAD_PRIORITY_NORMAL, -1};
+static BOOL lockMemory = FALSE;
+
+/** Parse an option value <priority>[,<CPU number>]. Return FALSE if it's invalid. */
+static BOOL parseThreadOptions(const char* value, ThreadOptions* options) {
+    static const struct {const char* name; int priority;} priorities[] = {
+        {"idle", THREAD_PRIORITY_IDLE},
+        {"lowest", THREAD_PRIORITY_LOWEST},
+        {"below", THREAD_PRIORITY_BELOW_NORMAL},
+        {"normal", THREAD_PRIORITY_NORMAL},
+        {"above", THREAD_PRIORITY_ABOVE_NORMAL},
+        {"highest", THREAD_PRIORITY_HIGHEST},
+        {"critical", THREAD_PRIORITY_TIME_CRITICAL}};
+    const char* comma = strchr(value, ',');
+    size_t length = (comma != NULL) ? (size_t) (comma - value) : strlen(value);
+    if (length > 0) {
+        int p = 0;
+        while (p < 7 && !(strlen(priorities[p].name) == length
+                          && strncmp(priorities[p].name, value, length) == 0)) ++p;
+        if (p >= 7) return FALSE;
+        options->setPriority = TRUE;
+        options->priority = priorities[p].priority;
+    }
+    if (comma != NULL) options->cpu = atoi(comma + 1);
+    return TRUE;
+}
+
+/** Apply options to the current thread. */
+static void setThreadOptions(ThreadOptions* options) {
+    if (options->setPriority && !SetThreadPriority(GetCurrentThread(), options->priority)) {
+        logLastError("SetThreadPriority");
+    }
+    if (options->cpu >= 0
+        && !SetThreadAffinityMask(GetCurrentThread(), ((DWORD_PTR) 1) << options->cpu)) {
+        logLastError("SetThreadAffinityMask");
+    }
+    if (options->setPriority || options->cpu >= 0) {
+        logDebug("%s thread priority %d CPU %d", options->name, options->priority, options->cpu);
+    }
+}
+
+static DWORD WINAPI stdinReader(LPVOID parameter) {
+    Port* port = (Port*) parameter;
+    setThreadOptions(&stdinThreadOptions);
+    while (TRUE) {
+        DWORD toRead = port->txBuffer.hasSpace();
+        if (toRead <= 0) {
+            WaitForSingleObject(port->txBuffer.notFull, INFINITE);
+            continue;
+        }
+        int wasRead = _read(stdinNumber, port->txBuffer.space(), toRead);
+        if (wasRead < 0) {
+            perror("_read(stdin)");
+            stdinDone = TRUE;
+            postOperation(&port->clientRead);
+            return errno;
+        }
+        logDebug("stdin read %d %s", wasRead, dump(port->txBuffer.space(), wasRead).text);
+        DWORD toAdd = wasRead;
+        if (oobEscape >= 0 && wasRead > 0) {
+            EnterCriticalSection(&port->lock);
+            toAdd = takeOob(port, port->txBuffer.space(), wasRead);
+            BOOL oob = (port->oobCount > 0);
+            LeaveCriticalSection(&port->lock);
+            if (oob) postOperation(&port->oobSend);
+        }
+        port->txBuffer.addData(toAdd);
+        if (wasRead == 0) {
+            stdinDone = TRUE;
+            postOperation(&port->clientRead);
+            return 0;
+        }
+        postOperation(&port->clientRead);
+    }
+}
+
+static DWORD WINAPI stdoutWriter(LPVOID parameter) {
+    Port* port = (Port*) parameter;
+    setThreadOptions(&stdoutThreadOptions);
+    while (TRUE) {
+        DWORD toWrite = port->rxBuffer.hasData();
+        if (toWrite <= 0) {
+            WaitForSingleObject(port->rxBuffer.notEmpty, INFINITE);
+            continue;
+        }
+        int wasWritten = _write(stdoutNumber, port->rxBuffer.data(), toWrite);
+        if (wasWritten < 0) {
             perror("_write(stdout)");
             stdoutDone = TRUE;
+            postOperation(&port->clientWrite);
             return errno;
         }
-        logDebug("stdout wrote %d %s", wasWritten, asString(rxBuffer.data(), wasWritten));
-        rxBuffer.removeData(wasWritten);
+        logDebug("stdout wrote %d %s", wasWritten, dump(port->rxBuffer.data(), wasWritten).text);
+        port->rxBuffer.removeData(wasWritten);
+        postOperation(&port->clientWrite);
+    }
+}
+
+static BYTE crc8(const BYTE* data, DWORD length) {
+    BYTE crc = 0;
+    for (DWORD d = 0; d < length; ++d) {
+        crc ^= data[d];
+        for (int b = 0; b < 8; ++b) {
+            crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+/** Return the remaining link with the most space in its txBuffer, and set
+    *linkSpace to that space. If it has less than needed, stall all the
+    links (to try again after some link transmits something) and return NULL.
+ */
+static BondLink* bondChooseLink(Bond* bond, DWORD needed, DWORD* linkSpace) {
+    BondLink* link = NULL;
+    *linkSpace = 0;
+    for (int l = 0; l < bond->linkCount; ++l) {
+        Port* port = bond->links[l].port;
+        if (port->comDone) continue;
+        DWORD space = port->txBuffer.spaceTotal();
+        if (space > *linkSpace) {
+            link = &bond->links[l];
+            *linkSpace = space;
+        }
+    }
+    if (link == NULL || *linkSpace < needed) {
+        for (int l = 0; l < bond->linkCount; ++l) {
+            bond->links[l].port->txStalled = TRUE;
+        }
+        return NULL;
+    }
+    return link;
+}
+
+/** Transmit the frames requeued from failed links. Return FALSE if some
+    remain, because none of the links has space for the next one. */
+static BOOL bondTxRequeued(Bond* bond) {
+    while (bond->requeuedLength > 0) {
+        DWORD length = bond->requeued[3] + BOND_FRAME_OVERHEAD;
+        DWORD linkSpace;
+        BondLink* link = bondChooseLink(bond, length, &linkSpace);
+        if (link == NULL) return FALSE;
+        link->port->txBuffer.put(bond->requeued, length);
+        logTrace("%s bond fragment %d requeued", link->port->comName,
+                 bond->requeued[1] | (bond->requeued[2] << 8));
+        bond->requeuedLength -= length;
+        memmove(bond->requeued, bond->requeued + length, bond->requeuedLength);
+        ++link->txFragments;
+        link->txBytes += length - BOND_FRAME_OVERHEAD;
+        comTx(link->port);
+    }
+    return TRUE;
+}
+
+/** Transmit fragments of the data from the client, until it has no more
+    data or none of the links has space for another fragment. */
+static void bondTx(Bond* bond) {
+    Port* client = bond->client;
+    BYTE frame[BOND_MAX_PAYLOAD + BOND_FRAME_OVERHEAD];
+    DWORD length;
+    if (!bondTxRequeued(bond)) return;
+    while ((length = client->txBuffer.hasData()) > 0) {
+        if (length > BOND_MAX_PAYLOAD) length = BOND_MAX_PAYLOAD;
+        DWORD linkSpace;
+        BondLink* link = bondChooseLink(bond, BOND_FRAME_OVERHEAD + 1, &linkSpace);
+        if (link == NULL) return;
+        if (length > linkSpace - BOND_FRAME_OVERHEAD) length = linkSpace - BOND_FRAME_OVERHEAD;
+        frame[0] = BOND_SYNC;
+        frame[1] = bond->txSequence & 0xFF;
+        frame[2] = bond->txSequence >> 8;
+        frame[3] = (BYTE) length;
+        memmove(frame + 4, client->txBuffer.data(), length);
+        frame[length + 4] = crc8(frame + 1, length + 3);
+        link->port->txBuffer.put(frame, length + BOND_FRAME_OVERHEAD);
+        client->txBuffer.removeData(length);
+        logTrace("%s bond fragment %d tx %d", link->port->comName, bond->txSequence, length);
+        ++bond->txSequence;
+        ++link->txFragments;
+        link->txBytes += length;
+        comTx(link->port);
+    }
+}
+
+/** Copy the next fragments (which were received out of order) to the client,
+    for as long as they're in sequence and the client has space. */
+static void bondDeliverStored(Bond* bond) {
+    while (TRUE) {
+        int slot = bond->rxSequence % BOND_WINDOW;
+        DWORD length = bond->fragmentLengths[slot];
+        if (length <= 0 || bond->fragmentSequences[slot] != bond->rxSequence) break;
+        if (!bond->client->rxBuffer.put(bond->fragments[slot], length)) {
+            bond->client->rxStalled = TRUE;
+            return;
+        }
+        bond->fragmentLengths[slot] = 0;
+        ++bond->rxSequence;
+        bond->waitingSince = 0;
+    }
+    for (int slot = 0; slot < BOND_WINDOW; ++slot) {
+        if (bond->fragmentLengths[slot] > 0) {
+            // A fragment is missing.
+            if (bond->waitingSince == 0) bond->waitingSince = microseconds();
+            return;
+        }
     }
 }
 
-/** Continue reading from comHandle. */
-static void comRx() {
-    /* There are several possible outcomes:
-       - Read enough bytes from comHandle to fill up rxBuffer.
-       - Read fewer bytes, in which case we wait for more bytes from comHandle.
-       - A read operation is PENDING, in which case we wait until it completes.
-       In any case, we don't want signals from rxBuffer.notFull;
-       reacting to such signals would be a waste of time. So:
-     */
-    if (!ResetEvent(rxBuffer.notFull)) {
-        logLastError("ResetEvent(rxBuffer.notFull)");
-    }
-    while (!comDone) {
-        BOOL justRead = FALSE;
-        BYTE* buffer = rxBuffer.space();
-        switch (comRxError) {
-        case ERROR_IO_INCOMPLETE:
-        case ERROR_IO_PENDING:
-            break;
-        default:
-            DWORD toRead = rxBuffer.hasSpace();
-            if (toRead <= 0) return;
-            comRxError = ReadFile(comHandle, buffer, toRead, NULL, &comRxOverlapped)
-                ? ERROR_SUCCESS : GetLastError();
-            logIOResult("comRx ReadFile", comRxError, toRead);
-            justRead = TRUE;
-        }
-        DWORD wasRead = 0;
-        switch (comRxError) {
-        case ERROR_IO_INCOMPLETE:
-        case ERROR_IO_PENDING:
-            if (justRead) return; // comRx() will be called later.
-        case ERROR_SUCCESS:
-            comRxError = GetOverlappedResult(comHandle, &comRxOverlapped, &wasRead, FALSE)
-                ? ERROR_SUCCESS : GetLastError();
-            switch (comRxError) {
-            case ERROR_IO_INCOMPLETE:
-            case ERROR_IO_PENDING:
-                return; // comRx() will be called later.
-            case ERROR_SUCCESS:
-                logDebug("comRx read %d %s", wasRead, asString(buffer, wasRead));
-                if (!ResetEvent(comRxOverlapped.hEvent)) {
-                    logLastError("comRx ResetEvent");
+/** Give up waiting for the fragment rxSequence. */
+static void bondSkip(Bond* bond) {
+    int slot = bond->rxSequence % BOND_WINDOW;
+    if (bond->fragmentLengths[slot] <= 0 || bond->fragmentSequences[slot] != bond->rxSequence) {
+        logInfo("bond lost fragment %d", bond->rxSequence);
+        ++bond->lost;
+        ++bond->rxSequence;
+        bond->waitingSince = 0;
+    }
+    bondDeliverStored(bond);
+}
+
+/** Deliver a fragment to the client, in sequence. Return FALSE if there's
+    no space for it yet, in which case try again later. */
+static BOOL bondDeliver(Bond* bond, WORD sequence, const BYTE* payload, DWORD length) {
+    WORD ahead = sequence - bond->rxSequence;
+    if (ahead >= 0x8000) return TRUE; // a fragment that was skipped
+    while (ahead >= BOND_WINDOW) {
+        // Too far ahead. Give up waiting for missing fragments.
+        if (bond->client->rxStalled) return FALSE;
+        bondSkip(bond);
+        ahead = sequence - bond->rxSequence;
+    }
+    if (ahead == 0) {
+        if (!bond->client->rxBuffer.put(payload, length)) return FALSE;
+        ++bond->rxSequence;
+        bond->waitingSince = 0;
+        bondDeliverStored(bond);
+    } else {
+        int slot = sequence % BOND_WINDOW;
+        memmove(bond->fragments[slot], payload, length);
+        bond->fragmentLengths[slot] = (BYTE) length;
+        bond->fragmentSequences[slot] = sequence;
+        if (bond->waitingSince == 0) bond->waitingSince = microseconds();
+    }
+    return TRUE;
+}
+
+/** Return the length of the valid frame at the start of link->frame,
+    or zero if it's incomplete. Discard bytes that aren't a valid frame. */
+static DWORD bondFrame(BondLink* link) {
+    BYTE* frame = link->frame;
+    while (link->frameLength > 0) {
+        if (frame[0] == BOND_SYNC) {
+            if (link->frameLength < 4) return 0;
+            DWORD length = frame[3];
+            if (length > 0 && length <= BOND_MAX_PAYLOAD) {
+                if (link->frameLength < length + BOND_FRAME_OVERHEAD) return 0;
+                if (crc8(frame + 1, length + 3) == frame[length + 4]) {
+                    return length + BOND_FRAME_OVERHEAD;
                 }
-                if (wasRead <= 0) return;
-                rxBuffer.addData(wasRead);
-                break;
-            default:
-                logError("comRx GetOverlappedResult", comRxError);
-                comDone = TRUE;
             }
-            break;
-        default:
-            logError("comRx ReadFile", comRxError);
-            comDone = TRUE;
+            ++link->rxErrors;
         }
+        // Discard bytes up to the next BOND_SYNC:
+        DWORD next = 1;
+        while (next < link->frameLength && frame[next] != BOND_SYNC) ++next;
+        link->frameLength -= next;
+        memmove(frame, frame + next, link->frameLength);
     }
+    return 0;
 }
 
-/** Continue writing to comHandle. */
-static void comTx() {
-    /* There are several possible outcomes:
-       - Write all the bytes from txBuffer to comHandle.
-       - Write fewer bytes, in which case we wait until comHandle can accept more.
-       - A write operation is PENDING, in which case we wait until it completes.
-       In any case, we don't want signals from txBuffer.notEmpty;
-       reacting to such signals would be a waste of time. So:
-     */
-    if (!ResetEvent(txBuffer.notEmpty)) {
-        logLastError("ResetEvent(txBuffer.notEmpty)");
-    }
-    while (!comDone) {
-        BOOL justWrote = FALSE;
-        BYTE* buffer = txBuffer.data();
-        switch (comTxError) {
-        case ERROR_IO_INCOMPLETE:
-        case ERROR_IO_PENDING:
-            break;
-        default:
-            DWORD toWrite = txBuffer.hasData();
-            if (toWrite <= 0) return;
-            comTxError = WriteFile(comHandle, txBuffer.data(), toWrite, NULL, &comTxOverlapped)
-                ? ERROR_SUCCESS : GetLastError();
-            logIOResult("comTx WriteFile", comTxError, toWrite);
-            justWrote = TRUE;
-        }
-        DWORD wasWritten = 0;
-        switch (comTxError) {
-        case ERROR_IO_INCOMPLETE:
-        case ERROR_IO_PENDING:
-            if (justWrote) return; // comTx() will be called later.
-        case ERROR_SUCCESS:
-            comTxError = GetOverlappedResult(comHandle, &comTxOverlapped, &wasWritten, FALSE)
-                ? ERROR_SUCCESS : GetLastError();
-            logIOResult("comTx GetOverlappedResult", comTxError, wasWritten);
-            switch (comTxError) {
-            case ERROR_IO_INCOMPLETE:
-            case ERROR_IO_PENDING:
-                return; // comTx() will be called later.
-            case ERROR_SUCCESS:
-                logDebug("comTx wrote %d %s", wasWritten, asString(buffer, wasWritten));
-                if (!ResetEvent(comTxOverlapped.hEvent)) {
-                    logLastError("comTx ResetEvent");
-                }
-                if (wasWritten <= 0) return;
-                txBuffer.removeData(wasWritten);
+/** Receive fragments from a link, and deliver them to the client. */
+static void bondRx(Port* port) {
+    Bond* bond = port->bond;
+    BondLink* link = &bond->links[port->bondLink];
+    while (TRUE) {
+        DWORD frameLength = bondFrame(link);
+        if (frameLength > 0) {
+            BYTE* frame = link->frame;
+            WORD sequence = frame[1] | (frame[2] << 8);
+            if (!bondDeliver(bond, sequence, frame + 4, frame[3])) {
+                // Try again after the client removes some data.
+                bond->client->rxStalled = TRUE;
                 break;
-            default:
-                logError("comTx GetOverlappedResult", comTxError);
-                comDone = TRUE;
             }
-            break;
-        default:
-            logError("comTx WriteFile", comTxError);
-            comDone = TRUE;
+            logTrace("%s bond fragment %d rx %d", port->comName, sequence, frame[3]);
+            ++link->rxFragments;
+            link->rxBytes += frame[3];
+            link->frameLength -= frameLength;
+            memmove(frame, frame + frameLength, link->frameLength);
+            continue;
         }
+        DWORD toCopy = port->rxBuffer.hasData();
+        DWORD room = sizeof(link->frame) - link->frameLength;
+        if (toCopy > room) toCopy = room;
+        if (toCopy <= 0) break;
+        memmove(link->frame + link->frameLength, port->rxBuffer.data(), toCopy);
+        link->frameLength += toCopy;
+        port->rxBuffer.removeData(toCopy);
     }
+    rxTaken(port, FALSE); // The bond's client has no RxArrivals.
+    rxFlow(port);
+    if (port->rxStalled) comRx(port);
 }
 
-/** Continue waiting for COM events. */
-static void comEvent() {
-    while (!comDone) {
-        switch (comEventError) {
-        case ERROR_IO_INCOMPLETE:
-        case ERROR_IO_PENDING:
-            break;
-        default:
-            comEventError = WaitCommEvent(comHandle, &comEventMask, &comEventOverlapped)
-                ? ERROR_SUCCESS : GetLastError();
-            logError("comEvent WaitCommEvent", comEventError);
-        }
-        switch (comEventError) {
-        case ERROR_IO_INCOMPLETE:
-        case ERROR_IO_PENDING:
-            DWORD dontCare;
-            comEventError = GetOverlappedResult(comHandle, &comEventOverlapped, &dontCare, FALSE)
-                ? ERROR_SUCCESS : GetLastError();
-            break;
-        case ERROR_SUCCESS:
+/** The client removed data from rxBuffer, so deliver more fragments. */
+static void bondRxAll(Bond* bond) {
+    bondDeliverStored(bond);
+    for (int l = 0; l < bond->linkCount; ++l) {
+        bondRx(bond->links[l].port);
+    }
+}
+
+/** Skip a missing fragment, if it's been missing for a while. */
+static void bondRetry(Bond* bond) {
+    if (bond->waitingSince != 0 && microseconds() - bond->waitingSince >= BOND_WAIT) {
+        bondSkip(bond);
+    }
+}
+
+static void logBondLink(BondLink* link) {
+    logInfo("%s bond link %stxFragments %d txBytes %d rxFragments %d rxBytes %d rxErrors %d retries %d",
+            link->port->comName, (link->port->comDone ? "comDone " : ""),
+            link->txFragments, link->txBytes, link->rxFragments, link->rxBytes, link->rxErrors,
+            link->port->retries);
+}
+
+/** Copy the frames in a failed link's txBuffer to bond->requeued, and
+    return how many there are. The first may have been partly transmitted,
+    so it's found the way the receiver would (see bondFrame); it and the
+    rest are whole frames. The txBuffer isn't changed, since the link's
+    operations may still complete.
+ */
+static DWORD bondRequeue(Bond* bond, Port* port) {
+    DWORD total = port->txBuffer.dataTotal();
+    if (total <= 0) return 0;
+    BYTE* data = new BYTE[total];
+    for (DWORD copied = 0; copied < total; ) {
+        DWORD length;
+        BYTE* from = port->txBuffer.dataAfter(copied, &length);
+        if (from == NULL) {
+            total = copied;
             break;
-        default:
-            logError("comEvent WaitCommEvent", comEventError);
-            comDone = TRUE;
-            return;
         }
-        switch (comEventError) {
-        case ERROR_IO_INCOMPLETE:
-        case ERROR_IO_PENDING:
-            return; // Try again later, when comEventOverlapped.hEvent is signaled.
-        case ERROR_SUCCESS:
-            if (!ResetEvent(comEventOverlapped.hEvent)) {
-                logLastError("comEvent ResetEvent");
-            }
-            if (logLevel >= TRACE) {
-                logTrace("comEvent%s%s%s%s%s%s%s%s%s",
-                         (comEventMask & EV_RXCHAR) ? " RXCHAR" : "",
-                         (comEventMask & EV_TXEMPTY) ? " TXEMPTY" : "",
-                         (comEventMask & EV_CTS) ? " CTS" : "",
-                         (comEventMask & EV_DSR) ? " DSR" : "",
-                         (comEventMask & EV_RLSD) ? " RLSD" : "",
-                         (comEventMask & EV_BREAK) ? " BREAK" : "",
-                         (comEventMask & EV_RXFLAG) ? " RXFLAG" : "",
-                         (comEventMask & EV_ERR) ? " ERR" : "",
-                         (comEventMask & EV_RING) ? " RING" : "");
-            }
-            if (comEventMask & EV_RXCHAR) {
-                comRx();
-            }
-            if (comEventMask & EV_TXEMPTY) {
-                comTx();
+        if (length > total - copied) length = total - copied;
+        memmove(data + copied, from, length);
+        copied += length;
+    }
+    DWORD start = 0;
+    while (start < total) {
+        DWORD length = (total - start > 3) ? data[start + 3] : 0;
+        if (data[start] == BOND_SYNC && length > 0 && length <= BOND_MAX_PAYLOAD
+            && start + length + BOND_FRAME_OVERHEAD <= total
+            && crc8(data + start + 1, length + 3) == data[start + length + 4]) break;
+        ++start;
+    }
+    DWORD frames = 0;
+    DWORD end = start;
+    while (end + 4 <= total && end + data[end + 3] + BOND_FRAME_OVERHEAD <= total) {
+        end += data[end + 3] + BOND_FRAME_OVERHEAD;
+        ++frames;
+    }
+    if (bond->requeuedLength + (end - start) > bond->requeuedSize) {
+        bond->requeuedSize = bond->requeuedLength + (end - start);
+        BYTE* requeued = new BYTE[bond->requeuedSize];
+        if (bond->requeuedLength > 0) memmove(requeued, bond->requeued, bond->requeuedLength);
+        delete[] bond->requeued;
+        bond->requeued = requeued;
+    }
+    if (end > start) memmove(bond->requeued + bond->requeuedLength, data + start, end - start);
+    bond->requeuedLength += end - start;
+    delete[] data;
+    return frames;
+}
+
+static void bondLinkFailed(Port* port) {
+    Bond* bond = port->bond;
+    logBondLink(&bond->links[port->bondLink]);
+    int remaining = 0;
+    for (int l = 0; l < bond->linkCount; ++l) {
+        if (!bond->links[l].port->comDone) ++remaining;
+    }
+    if (remaining <= 0) {
+        logInfo("bond has no links remaining; %d bytes queued for %s and %d requeued are lost",
+                port->txBuffer.dataTotal(), port->comName, bond->requeuedLength);
+        bond->client->comDone = TRUE;
+        return;
+    }
+    DWORD frames = bondRequeue(bond, port);
+    logInfo("bond has %d links remaining; %d fragments queued for %s are requeued",
+            remaining, frames, port->comName);
+    bondTx(bond);
+}
+
+/** Parse a --bond option value <COM port name>,<COM port name>... */
+static Bond* newBond(const char* value) {
+    Bond* bond = new Bond();
+    memset(bond, 0, sizeof(*bond));
+    bond->client = new Port("bond", NULL, rxBufferSize);
+    bond->client->bond = bond;
+    char* names = _strdup(value);
+    bond->linkCount = 1;
+    for (char* c = names; *c; ++c) {
+        if (*c == ',') ++bond->linkCount;
+    }
+    bond->links = new BondLink[bond->linkCount];
+    memset(bond->links, 0, bond->linkCount * sizeof(BondLink));
+    char* name = names;
+    for (int l = 0; l < bond->linkCount; ++l) {
+        char* comma = strchr(name, ',');
+        if (comma != NULL) *comma = 0;
+        Port* link = new Port(name, NULL, rxBufferSize);
+        link->bond = bond;
+        link->bondLink = l;
+        bond->links[l].port = link;
+        if (comma != NULL) name = comma + 1;
+    }
+    return bond;
+}
+
+/** Alert the engine when the parent process rings a doorbell in shared memory. */
+static DWORD WINAPI shmWatcher(LPVOID parameter) {
+    Port* port = (Port*) parameter;
+    setThreadOptions(&stdinThreadOptions);
+    HANDLE bells[] = {port->shm.toComData, port->shm.fromComSpace};
+    while (TRUE) {
+        // Either bell may have rung, even if WAIT_OBJECT_0 + N indicates only one (see above).
+        postOperation(&port->clientRead);
+        postOperation(&port->clientWrite);
+        if (WaitForMultipleObjects(2, bells, FALSE, INFINITE) == WAIT_FAILED) {
+            logLastError("shmWatcher WaitForMultipleObjects");
+            flightDump("WAIT_FAILED");
+            return 1;
+        }
+    }
+}
+
+/** Open the COM port and the client, and start the first operations.
+    Return an exit code; zero indicates success.
+ */
+static int portOpen(Port* port) {
+    if (port->bond != NULL && port->bondLink < 0) {
+        // The bond's client has no COM port of its own.
+        startOperation(&port->clientRead, port, txBufferAdded);
+        startOperation(&port->clientWrite, port, rxBufferRemoved);
+        port->clientConnected = TRUE;
+        startOperation(&port->oobSend, port, oobSendDone);
+        CreateThread(NULL, 2048, stdinReader, port, 0, NULL);
+        CreateThread(NULL, 2048, stdoutWriter, port, 0, NULL);
+        return 0;
+    }
+    if (port->replay != NULL) {
+        DCB comState = {0};
+        comState.BaudRate = baudRate;
+        comState.ByteSize = 8;
+        comState.Parity = NOPARITY;
+        comState.StopBits = ONESTOPBIT;
+        port->rxGapMicroseconds = rxGapTime(&comState);
+        DWORD err = replayStart(port);
+        if (err != ERROR_SUCCESS) {
+            logError(port->replay->fileName, err);
+            return 3;
+        }
+    } else {
+        logDebug("CreateFile(%s)", port->comName);
+        port->comHandle = CreateFile(port->comName,
+                                     GENERIC_READ | GENERIC_WRITE,
+                                     0, // not shared
+                                     NULL, // no security
+                                     OPEN_EXISTING,
+                                     FILE_FLAG_OVERLAPPED,
+                                     NULL); // template file
+        if (port->comHandle == INVALID_HANDLE_VALUE) {
+            DWORD err = GetLastError();
+            LPTSTR message = errorMessage(err);
+            logInfo("CreateFile(%s) error %d %s", port->comName, err, (message == NULL) ? "" : message);
+            if (message != NULL) LocalFree(message);
+            return 3;
+        }
+        int commCode = setComm(port->comHandle, &port->rxGapMicroseconds);
+        if (commCode != 0) {
+            CloseHandle(port->comHandle);
+            port->comHandle = INVALID_HANDLE_VALUE;
+            return commCode;
+        }
+        if (rxReadCount > 0) {
+            if (port->rxReads == NULL) port->rxReads = new RxRead[rxReadCount];
+            memset(port->rxReads, 0, rxReadCount * sizeof(RxRead));
+        }
+        DWORD err = completions.associate(port->comHandle, port);
+        if (err != ERROR_SUCCESS) {
+            logError("CreateIoCompletionPort", err);
+            return 8;
+        }
+    }
+    if (txWriteCount > 1) {
+        if (port->txWrites == NULL) port->txWrites = new TxWrite[txWriteCount];
+        memset(port->txWrites, 0, txWriteCount * sizeof(TxWrite));
+    }
+    DWORD err;
+    if (port->bond != NULL) {
+        port->clientConnected = TRUE; // Its client is the bond.
+    } else if (port->shmName != NULL) {
+        err = comProxyShmOpen(&port->shm, port->shmName);
+        if (err != ERROR_SUCCESS) {
+            logError("comProxyShmOpen", err);
+            return 9;
+        }
+        // The buffers are in shared memory; no data are copied into or out of them.
+        ComProxyShmView* view = &port->shm;
+        port->txBuffer.share(&view->shm->toCom, view->toComBuffer, view->shm->size,
+                             view->toComData, view->toComSpace);
+        port->rxBuffer.share(&view->shm->fromCom, view->fromComBuffer, view->shm->size,
+                             view->fromComData, view->fromComSpace);
+        startOperation(&port->clientRead, port, txBufferAdded);
+        startOperation(&port->clientWrite, port, rxBufferRemoved);
+        port->clientConnected = TRUE;
+        CreateThread(NULL, 2048, shmWatcher, port, 0, NULL);
+    } else if (port->pipeName == NULL) {
+        startOperation(&port->clientRead, port, txBufferAdded);
+        startOperation(&port->clientWrite, port, rxBufferRemoved);
+        port->clientConnected = TRUE;
+        startOperation(&port->oobSend, port, oobSendDone);
+        CreateThread(NULL, 2048, stdinReader, port, 0, NULL);
+        CreateThread(NULL, 2048, stdoutWriter, port, 0, NULL);
+    } else {
+        logDebug("CreateNamedPipe(%s)", port->pipeName);
+        port->pipeHandle = CreateNamedPipe(port->pipeName,
+                                           PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED
+                                           | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                           PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT
+                                           | PIPE_REJECT_REMOTE_CLIENTS,
+                                           1, // one client at a time
+                                           4096, 4096, // buffer sizes
+                                           0, // default timeout
+                                           NULL); // no security
+        if (port->pipeHandle == INVALID_HANDLE_VALUE) {
+            logLastError("CreateNamedPipe");
+            return 7;
+        }
+        err = completions.associate(port->pipeHandle, port);
+        if (err != ERROR_SUCCESS) {
+            logError("CreateIoCompletionPort", err);
+            return 8;
+        }
+        pipeConnect(port);
+    }
+    comEvent(port);
+    return 0;
+}
+
+/** Retry operations that might not be indicated by any COM event. */
+static void retry(Port* port) {
+    /* A Read may complete immediately with zero bytes read, and
+       a Write may complete immediately with zero bytes written.
+       Repeating the operation will complete immediately again.
+       WaitCommEvent might indicate when to retry, but NOT always.
+       So retry after a delay (see scheduleRetry):
+    */
+    trace(port, COM_PROXY_TRACE_RETRY, (DWORD) port->retryDelay, 0, 0);
+    ++port->counters.retryTimeouts;
+    port->retryDue = 0;
+    port->retryDelay *= 2;
+    if (port->retryDelay > RETRY_MAX) port->retryDelay = RETRY_MAX;
+    if (port->rxReads == NULL // The posted reads don't need retrying.
+        && port->rxBuffer.hasSpace() && !port->comRx.pending && !port->comDone) {
+        logTrace("%s comRx retry", port->comName);
+        port->rxRetried = TRUE;
+        comRx(port);
+    }
+    if (port->oobCount > 0) comOob(port);
+    rxFlow(port);
+    if (port->txBuffer.hasData() && !port->comTx.pending && !port->comDone) {
+        logTrace("%s comTx retry", port->comName);
+        port->txRetried = TRUE;
+        comTx(port);
+    }
+}
+
+/** Return the time (from microseconds) at which the engine must next
+    retry some port, at most RETRY_MAX after now.
+ */
+static LONGLONG retrySoonest(LONGLONG now) {
+    LONGLONG soonest = now + RETRY_MAX;
+    for (Port* port = ports; port != NULL; port = port->next) {
+        LONGLONG due = port->retryDue; // not locked, so it may be stale
+        if (due != 0 && due < soonest) soonest = due;
+        due = port->rxFlushDue;
+        if (due != 0 && due < soonest) soonest = due;
+        due = port->txFlushDue;
+        if (due != 0 && due < soonest) soonest = due;
+    }
+    return soonest;
+}
+
+/** Return how many milliseconds the engine may wait for a completion,
+    before it must retry some port.
+ */
+static DWORD retryTimeout() {
+    LONGLONG now = microseconds();
+    LONGLONG soonest = retrySoonest(now);
+    /* Round up, so the engine doesn't poll (with a zero timeout) while a
+       retry is due in less than a millisecond. */
+    return (soonest <= now) ? 0 : (DWORD) ((soonest - now + 999) / 1000);
+}
+
+/* With --spin=<microseconds>, the engine doesn't wait for a completion
+   right away. Instead it polls the completion port and the ports' buffers
+   for that long, which reduces latency at the cost of keeping a CPU busy.
+   The latency from postOperation to the engine is recorded in
+   latencyHistogram, and the latency from a COM read's completion to the
+   client taking its data (as the engine learns of it) in
+   rxLatencyHistogram. Both are logged at exit, with or without --spin.
+   --spin=<microseconds>,<CPU number> sets the CPU of the main engine thread
+   only, so it may not be combined with --engine-thread=...,<CPU number>
+   (which sets the CPU of every engine thread).
+ */
+static LONGLONG spinMicroseconds = 0;
+static int spinCpu = -1; // the CPU on which the main engine thread runs, or -1
+static void logLatencyHistogram(const char* what, LONG volatile* histogram) {
+    logInfo("latency from %s%s:", what, (spinMicroseconds > 0) ? " (spinning)" : "");
+    for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+        if (histogram[b] > 0) {
+            logInfo("  %s %8d usec: %d", (b < LATENCY_BUCKETS - 1) ? "<" : ">=",
+                    1 << ((b < LATENCY_BUCKETS - 1) ? b : (b - 1)), histogram[b]);
+        }
+    }
+}
+
+/** Start any COM operations that the ports' buffers indicate, without waiting
+    for posted completions. Skip ports that are locked by other threads.
+ */
+static void spinPoll() {
+    for (Port* port = ports; port != NULL; port = port->next) {
+        if (port->isBroker || !TryEnterCriticalSection(&port->lock)) continue;
+        if (port->txBuffer.hasData() > 0) comTx(port);
+        if (port->rxStalled && port->rxBuffer.hasSpace() > 0) comRx(port);
+        checkActive(port);
+        LeaveCriticalSection(&port->lock);
+    }
+}
+
+/** Like completions.next, but poll for up to spinMicroseconds first.
+    Stop polling early only when some port's retry is due, so the engine
+    handles it (after completions.next times out right away).
+ */
+static DWORD nextCompletion(Operation** op, DWORD* count) {
+    if (spinMicroseconds > 0) {
+        LONGLONG until = microseconds() + spinMicroseconds;
+        LONGLONG now;
+        do {
+            DWORD err = completions.next(op, count, 0);
+            if (*op != NULL || err != WAIT_TIMEOUT) return err;
+            spinPoll();
+            now = microseconds();
+        } while (now < until && retrySoonest(now) > now);
+    }
+    return completions.next(op, count, retryTimeout());
+}
+
+/** Handle the next completed operation, or the retries that are due if none
+    completes in time. Return -1 to continue, or else an exit code.
+ */
+static int engineStep() {
+    Operation* op = NULL;
+    DWORD count = 0;
+    DWORD err = nextCompletion(&op, &count);
+    if (op != NULL) {
+        Port* port = op->port;
+        EnterCriticalSection(&port->lock);
+        if (op->postedAt != 0) {
+            recordLatency(latencyHistogram, microseconds() - op->postedAt);
+            op->postedAt = 0;
+        }
+        op->pending = FALSE;
+        InterlockedExchange(&op->posted, FALSE);
+        op->complete(port, err, count);
+        checkActive(port);
+        if (port->bond != NULL) checkActive(port->bond->client);
+        LeaveCriticalSection(&port->lock);
+        return -1;
+    }
+    switch (err) {
+    case ERROR_SUCCESS:
+        return 0; // stopped
+    case WAIT_TIMEOUT: {
+        LONGLONG now = microseconds();
+        for (Port* port = ports; port != NULL; port = port->next) {
+            EnterCriticalSection(&port->lock);
+            if (port->retryDue != 0 && port->retryDue <= now) retry(port);
+            if (port->rxFlushDue != 0 && port->rxFlushDue <= now) rxFlush(port);
+            if (port->txFlushDue != 0 && port->txFlushDue <= now) {
+                port->txFlushDue = 0;
+                comTx(port);
             }
-            break;
-        default:
-            logError("comEvent GetOverlappedResult", comEventError);
-            comDone = TRUE;
-            return;
+            if (port->bond != NULL && port->bondLink < 0) bondRetry(port->bond);
+            checkActive(port);
+            LeaveCriticalSection(&port->lock);
+        }
+        return -1;
+    }
+    default:
+        logError("GetQueuedCompletionStatus", err);
+        flightDump("GetQueuedCompletionStatus failed");
+        return 4;
+    }
+}
+
+/** Handle completed operations, until all the ports are inactive.
+    Return an exit code.
+ */
+static DWORD WINAPI engine(LPVOID parameter) {
+    setThreadOptions(&engineThreadOptions);
+    int code;
+    while ((code = engineStep()) < 0) {}
+    return code;
+}
+
+/** If arg is --name=value, return value. Otherwise return NULL. */
+static const char* optionValue(const char* arg, const char* name) {
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) == 0 && arg[length] == '=') {
+        return arg + length + 1;
+    }
+    return NULL;
+}
+
+/** Parse a --port option value <COM port name>[,<pipe name>]. */
+static Port* newPort(const char* value) {
+    char* comName = _strdup(value);
+    char* pipeName;
+    char* comma = strchr(comName, ',');
+    if (comma != NULL) {
+        *comma = 0;
+        pipeName = comma + 1;
+    } else {
+        // The default is \\.\pipe\comProxy-COM3 (even if comName is \\.\COM3).
+        const char* baseName = strrchr(comName, '\\');
+        baseName = (baseName == NULL) ? comName : baseName + 1;
+        pipeName = new char[strlen(baseName) + 20];
+        sprintf(pipeName, "\\\\.\\pipe\\comProxy-%s", baseName);
+    }
+    // With a backlog, rxBuffer holds data while no client is connected.
+    return new Port(comName, pipeName, (backlogSize > rxBufferSize) ? backlogSize : rxBufferSize);
+}
+
+/** Open a port and add it to the list of ports.
+    Return an exit code; zero indicates success.
+ */
+static int startPort(Port* port) {
+    // Some of its operations may complete before portOpen returns.
+    EnterCriticalSection(&port->lock);
+    traceName(port);
+    int openCode = portOpen(port);
+    if (lockMemory) {
+        if (!VirtualLock(port, sizeof(Port))) logLastError("VirtualLock Port");
+        port->rxBuffer.lockMemory();
+        port->txBuffer.lockMemory();
+    }
+    if (openCode != 0) port->comDone = TRUE;
+    port->active = port->isActive();
+    if (port->active) InterlockedIncrement(&activePorts);
+    LeaveCriticalSection(&port->lock);
+    MemoryBarrier(); // before other threads can find port in the list
+    *lastPort = port;
+    lastPort = &port->next;
+    return openCode;
+}
+
+/* The broker: a client asks the broker to open a COM port, by connecting to
+   the broker's pipe and writing a line containing the COM port name. The
+   broker opens the COM port and its pipe (unless they're open already),
+   replies with a line containing the pipe name (or "error"), and waits for
+   the client to disconnect. The client then connects to the COM port's pipe.
+
+   A client may also write "log-level=<level>", "log-file=<file name>" or
+   "flight-dump" (which writes the flight recorder to the log), to which
+   the broker replies "ok" or "error". Since any local client can write
+   these, log-file only accepts a plain file name, which is created in the
+   directory of the log file named on the command line.
+
+   COM ports stay open and configured after their clients disconnect, so the
+   next client doesn't wait for CreateFile and setComm (nor toggle DTR).
+   With --backlog, data received while no client is connected are kept for
+   the next client.
+ */
+static Port* broker = NULL;
+static char brokerBuffer[MAX_PATH + 100];
+static DWORD brokerLength = 0;
+
+static void brokerConnectDone(Port* broker, DWORD err, DWORD count);
+static void brokerReadDone(Port* broker, DWORD err, DWORD count);
+static void brokerWriteDone(Port* broker, DWORD err, DWORD count);
+static void brokerDrainDone(Port* broker, DWORD err, DWORD count);
+
+/** Wait for the next client to connect to the broker. */
+static void brokerListen(Port* broker) {
+    brokerLength = 0;
+    LPOVERLAPPED overlapped = startOperation(&broker->clientConnect, broker, brokerConnectDone);
+    DWORD err = ConnectNamedPipe(broker->pipeHandle, overlapped) ? ERROR_SUCCESS : GetLastError();
+    switch (err) {
+    case ERROR_SUCCESS:
+    case ERROR_IO_PENDING:
+        broker->clientConnect.pending = TRUE;
+        break;
+    case ERROR_PIPE_CONNECTED:
+        brokerConnectDone(broker, ERROR_SUCCESS, 0);
+        break;
+    default:
+        logError("broker ConnectNamedPipe", err);
+    }
+}
+
+static void brokerDisconnect(Port* broker) {
+    if (!DisconnectNamedPipe(broker->pipeHandle)) {
+        logLastError("broker DisconnectNamedPipe");
+    }
+    brokerListen(broker);
+}
+
+static void brokerRead(Port* broker, void (*complete)(Port*, DWORD, DWORD)) {
+    LPOVERLAPPED overlapped = startOperation(&broker->clientRead, broker, complete);
+    DWORD err = startedOperation
+        (&broker->clientRead, ReadFile(broker->pipeHandle, brokerBuffer + brokerLength,
+                                       sizeof(brokerBuffer) - 1 - brokerLength, NULL, overlapped));
+    if (err != ERROR_SUCCESS) {
+        logError("broker ReadFile", err);
+        brokerDisconnect(broker);
+    }
+}
+
+static void brokerConnectDone(Port* broker, DWORD err, DWORD count) {
+    if (err != ERROR_SUCCESS) {
+        logError("broker ConnectNamedPipe", err);
+        brokerDisconnect(broker);
+        return;
+    }
+    brokerRead(broker, brokerReadDone);
+}
+
+/** Return TRUE if name is COM<n> or \\.\COM<n>, where n is 1 to 256.
+    A client may not make the broker open any other file.
+ */
+static BOOL isComName(const char* name) {
+    if (strncmp(name, "\\\\.\\", 4) == 0) name += 4;
+    if (_strnicmp(name, "COM", 3) != 0) return FALSE;
+    const char* digits = name + 3;
+    size_t length = strlen(digits);
+    if (length < 1 || length > 3 || digits[0] == '0' || strspn(digits, "0123456789") != length) return FALSE;
+    return atoi(digits) <= 256;
+}
+
+/** Close a Port that failed and has no operations pending, and reset its
+    state, so portOpen can open it again. Its statistics are kept.
+ */
+static void portReset(Port* port) {
+    if (port->pipeHandle != INVALID_HANDLE_VALUE) CloseHandle(port->pipeHandle);
+    if (port->comHandle != INVALID_HANDLE_VALUE) CloseHandle(port->comHandle);
+    port->pipeHandle = port->comHandle = INVALID_HANDLE_VALUE;
+    port->comDone = FALSE;
+    port->clientConnected = FALSE;
+    port->rxStalled = port->txStalled = FALSE;
+    port->retryDue = 0;
+    port->retryDelay = RETRY_MIN;
+    port->rxRetried = port->txRetried = FALSE;
+    port->rxReadNext = port->txWriteNext = port->txWriting = 0;
+    port->txInFlight = 0;
+    port->txRewinding = FALSE;
+    port->rxHeld = 0;
+    port->rxFlushDue = 0;
+    port->rxFlowStopped = FALSE;
+    port->oobEscaped = FALSE;
+    port->oobCount = 0;
+    port->txWaitingSince = port->txFlushDue = port->txIdleSince = 0;
+    DWORD count;
+    while ((count = port->rxBuffer.hasData()) > 0) port->rxBuffer.removeData(count);
+    while ((count = port->txBuffer.hasData()) > 0) port->txBuffer.removeData(count);
+    port->rxReceived = port->rxBuffer.added;
+    port->rxArrivalCount = 0;
+}
+
+/** Find the open Port for comName, or open it. Return NULL if it can't be opened.
+    A Port that failed is opened again, rather than replaced, so ports (which
+    other threads walk without a lock) only grows with distinct COM names.
+ */
+static Port* brokerOpen(const char* comName) {
+    for (Port* port = ports; port != NULL; port = port->next) {
+        if (_stricmp(port->comName, comName) == 0) {
+            EnterCriticalSection(&port->lock);
+            int openCode = 0;
+            if (port->comDone && !port->active) {
+                logInfo("%s opening again", port->comName);
+                portReset(port);
+                openCode = portOpen(port);
+                if (openCode != 0) port->comDone = TRUE;
+                port->active = port->isActive();
+                if (port->active) InterlockedIncrement(&activePorts);
+            }
+            BOOL open = (openCode == 0 && !port->comDone);
+            LeaveCriticalSection(&port->lock);
+            return open ? port : NULL;
+        }
+    }
+    Port* port = newPort(comName);
+    return (startPort(port) == 0) ? port : NULL;
+}
+
+static void brokerReadDone(Port* broker, DWORD err, DWORD count) {
+    if (err != ERROR_SUCCESS) {
+        logError("broker ReadFile", err);
+        brokerDisconnect(broker);
+        return;
+    }
+    brokerLength += count;
+    brokerBuffer[brokerLength] = 0;
+    char* end = strpbrk(brokerBuffer, "\r\n");
+    if (end == NULL) {
+        if (brokerLength < sizeof(brokerBuffer) - 1) {
+            brokerRead(broker, brokerReadDone); // the rest of the line
+        } else {
+            logInfo("broker request too long");
+            brokerDisconnect(broker);
+        }
+        return;
+    }
+    *end = 0;
+    const char* reply;
+    if (strncmp(brokerBuffer, "log-level=", 10) == 0) {
+        int level = parseLogLevel(brokerBuffer + 10);
+        if (level >= 0) setLogLevel(level);
+        reply = (level >= 0) ? "ok" : "error";
+    } else if (strcmp(brokerBuffer, "flight-dump") == 0) {
+        flightDump("requested");
+        reply = "ok";
+    } else if (strncmp(brokerBuffer, "log-file=", 9) == 0) {
+        BOOL ok = setLogFile(brokerBuffer + 9);
+        if (!ok) logInfo("broker log-file=%s rejected", brokerBuffer + 9);
+        reply = ok ? "ok" : "error";
+    } else {
+        const char* comName = brokerBuffer;
+        // A client may not choose the pipe name, nor open anything but a COM port.
+        Port* port = isComName(comName) ? brokerOpen(comName) : NULL;
+        logInfo("broker %s %s", comName, (port == NULL) ? "error" : port->pipeName);
+        reply = (port == NULL) ? "error" : port->pipeName;
+    }
+    int length = _snprintf(brokerBuffer, sizeof(brokerBuffer) - 1, "%s\n", reply);
+    brokerLength = (length < 0) ? 0 : length;
+    LPOVERLAPPED overlapped = startOperation(&broker->clientWrite, broker, brokerWriteDone);
+    err = startedOperation
+        (&broker->clientWrite, WriteFile(broker->pipeHandle, brokerBuffer, brokerLength, NULL, overlapped));
+    if (err != ERROR_SUCCESS) {
+        logError("broker WriteFile", err);
+        brokerDisconnect(broker);
+    }
+}
+
+static void brokerWriteDone(Port* broker, DWORD err, DWORD count) {
+    if (err != ERROR_SUCCESS) {
+        logError("broker WriteFile", err);
+        brokerDisconnect(broker);
+        return;
+    }
+    /* DisconnectNamedPipe would discard the reply, if the client hasn't read it yet.
+       So wait for the client to disconnect, ignoring anything else it writes.
+    */
+    brokerLength = 0;
+    brokerRead(broker, brokerDrainDone);
+}
+
+static void brokerDrainDone(Port* broker, DWORD err, DWORD count) {
+    if (err != ERROR_SUCCESS) {
+        brokerDisconnect(broker); // the client disconnected
+    } else {
+        brokerRead(broker, brokerDrainDone);
+    }
+}
+
+/** Create the broker's pipe, and wait for a client.
+    Return an exit code; zero indicates success.
+ */
+static int brokerStart(const char* pipeName) {
+    broker = new Port("broker", pipeName);
+    broker->isBroker = TRUE;
+    broker->comDone = TRUE; // It has no COM port.
+    logDebug("CreateNamedPipe(%s)", pipeName);
+    broker->pipeHandle = CreateNamedPipe(pipeName,
+                                         PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED
+                                         | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                         PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT
+                                         | PIPE_REJECT_REMOTE_CLIENTS,
+                                         1, // one client at a time
+                                         512, 512, // buffer sizes
+                                         0, // default timeout
+                                         NULL); // no security
+    if (broker->pipeHandle == INVALID_HANDLE_VALUE) {
+        logLastError("CreateNamedPipe");
+        return 7;
+    }
+    DWORD err = completions.associate(broker->pipeHandle, broker);
+    if (err != ERROR_SUCCESS) {
+        logError("CreateIoCompletionPort", err);
+        return 8;
+    }
+    broker->active = TRUE;
+    InterlockedIncrement(&activePorts);
+    EnterCriticalSection(&broker->lock);
+    brokerListen(broker);
+    LeaveCriticalSection(&broker->lock);
+    return 0;
+}
+
+/* With --stats=<seconds>[,json], a thread logs each port's counters at
+   that interval, as a line of text or a JSON object. They're also logged
+   at exit (with or without --stats).
+ */
+static DWORD statsSeconds = 0;
+static BOOL statsJson = FALSE;
+static HANDLE statsThread = NULL;
+static HANDLE statsStop = NULL; // set by stopStats
+
+/** Log port->counters, in one line. */
+static void logCounters(Port* port) {
+    // A snapshot, so 64-bit counters aren't torn by other threads:
+    EnterCriticalSection(&port->lock);
+    Counters c = port->counters;
+    LeaveCriticalSection(&port->lock);
+    LONGLONG clientTxBytes, clientRxBytes, other;
+    DWORD txOverruns, rxOverruns;
+    port->txBuffer.statistics(&clientTxBytes, &other, &txOverruns);
+    port->rxBuffer.statistics(&other, &clientRxBytes, &rxOverruns);
+    char line[MAX_MESSAGE - 40];
+    int length;
+    if (statsJson) {
+        char name[100]; // port->comName, escaped
+        int n = 0;
+        for (const char* from = port->comName; *from != 0 && n < (int) sizeof(name) - 2; ++from) {
+            if (*from == '\\' || *from == '"') name[n++] = '\\';
+            name[n++] = *from;
         }
+        name[n] = 0;
+        length = snprintf(line, sizeof(line),
+                          "{\"port\":\"%s\",\"rxBytes\":%lld,\"txBytes\":%lld,"
+                          "\"clientTxBytes\":%lld,\"clientRxBytes\":%lld,"
+                          "\"reads\":%lu,\"writes\":%lu,\"rxZero\":%lu,\"txZero\":%lu,"
+                          "\"ioPending\":%lu,\"retryTimeouts\":%lu,\"rxStalls\":%lu,\"txStalls\":%lu,"
+                          "\"overruns\":%lu,\"comEvents\":{",
+                          name, c.rxBytes, c.txBytes,
+                          clientTxBytes, clientRxBytes,
+                          (unsigned long) c.reads, (unsigned long) c.writes,
+                          (unsigned long) c.rxZero, (unsigned long) c.txZero,
+                          (unsigned long) c.ioPending, (unsigned long) c.retryTimeouts,
+                          (unsigned long) c.rxStalls, (unsigned long) c.txStalls,
+                          (unsigned long) (rxOverruns + txOverruns));
+        for (int b = 0; b < COM_EVENT_BITS && length < (int) sizeof(line); ++b) {
+            length += snprintf(line + length, sizeof(line) - length, "%s\"%s\":%lu",
+                               (b > 0) ? "," : "", comEventNames[b], (unsigned long) c.comEvents[b]);
+        }
+        if (length < (int) sizeof(line)) snprintf(line + length, sizeof(line) - length, "}}");
+    } else {
+        length = snprintf(line, sizeof(line),
+                          "%s stats rxBytes %lld txBytes %lld clientTxBytes %lld clientRxBytes %lld"
+                          " reads %lu writes %lu rxZero %lu txZero %lu ioPending %lu retryTimeouts %lu"
+                          " rxStalls %lu txStalls %lu overruns %lu",
+                          port->comName, c.rxBytes, c.txBytes,
+                          clientTxBytes, clientRxBytes,
+                          (unsigned long) c.reads, (unsigned long) c.writes,
+                          (unsigned long) c.rxZero, (unsigned long) c.txZero,
+                          (unsigned long) c.ioPending, (unsigned long) c.retryTimeouts,
+                          (unsigned long) c.rxStalls, (unsigned long) c.txStalls,
+                          (unsigned long) (rxOverruns + txOverruns));
+        for (int b = 0; b < COM_EVENT_BITS && length < (int) sizeof(line); ++b) {
+            if (c.comEvents[b] <= 0) continue;
+            length += snprintf(line + length, sizeof(line) - length, " EV_%s %lu",
+                               comEventNames[b], (unsigned long) c.comEvents[b]);
+        }
+    }
+    logInfo("%s", line);
+}
+
+static DWORD WINAPI statsReporter(LPVOID parameter) {
+    while (WaitForSingleObject(statsStop, statsSeconds * 1000) == WAIT_TIMEOUT) {
+        for (Port* port = ports; port != NULL; port = port->next) {
+            logCounters(port);
+        }
+    }
+    return 0;
+}
+
+/** Stop statsReporter, and wait for it to finish. */
+static void stopStats() {
+    if (statsThread == NULL) return;
+    SetEvent(statsStop);
+    WaitForSingleObject(statsThread, INFINITE);
+    CloseHandle(statsThread);
+    statsThread = NULL;
+}
+
+static void logComStats(Port* port) {
+    logCounters(port);
+    if (oobEscape >= 0 && port->oobSent + port->oobDropped > 0) {
+        logInfo("%s oobSent %d oobDropped %d oobLatencyAverage %d usec oobLatencyMax %d usec",
+                port->comName, port->oobSent, port->oobDropped,
+                (int) (port->oobSent > 0 ? port->oobLatencyTotal / port->oobSent : 0),
+                (int) port->oobLatencyMax);
+    }
+    if (port->comHandle == INVALID_HANDLE_VALUE) return;
+    logInfo("%s rxQueueMax %d frameErrors %d overrunErrors %d rxOverErrors %d parityErrors %d breaks %d",
+            port->comName, port->rxQueueMax, port->frameErrors, port->overrunErrors,
+            port->rxOverErrors, port->parityErrors, port->breaks);
+    if (rxFlowControl != RX_FLOW_NONE) {
+        logInfo("%s rxFlowStops %d", port->comName, port->rxFlowStops);
     }
+    logInfo("%s txGaps %d txGapAverage %d usec txGapMax %d usec txRewinds %d",
+            port->comName, port->txGaps,
+            (int) (port->txGaps > 0 ? port->txGapTotal / port->txGaps : 0),
+            (int) port->txGapMax, port->txRewinds);
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [<options>] [--shm=<name>] <COM port name> [<log file name>]\n"
+            "       %s [<options>] [--backlog=<bytes>] [--broker[=<pipe name>]]\n"
+            "          [--port=<COM port name>[,<pipe name>] ...] [<log file name>]\n"
+            "       %s [<options>] --bond=<COM port name>,<COM port name>... [<log file name>]\n"
+            "options: [--threads=<number>] [--rx-reads=<number>] [--tx-writes=<number>]\n"
+            "         [--spin=<microseconds>[,<CPU number>]] [--rx-gap=<characters>[,<bytes>]]\n"
+            "         [--tx-coalesce=<microseconds>[,<bytes>[,<delimiter byte>]]]\n"
+            "         [--oob=<escape byte>] [--rx-buffer=<bytes>]\n"
+            "         [--rx-flow=rts|xon[,<high bytes>[,<low bytes>]]]\n"
+            "         [--priority=idle|below|normal|above|high|realtime] [--lock-memory]\n"
+            "         [--engine-thread=<priority>[,<CPU number>]] (also --stdin-thread, --stdout-thread)\n"
+            "         [--trace=<file name>[,<records>]]\n"
+            "         [--log-level=none|info|debug|trace] [--log=<log file name>]\n"
+            "         [--dump=printable|hex|c[,<max bytes>]] [--capture=<file name>]\n"
+            "         [--replay=<capture file name>[,<speed>]] (with one COM port)\n"
+            "         [--stats=<seconds>[,json]]\n"
+            "where <priority> is idle|lowest|below|normal|above|highest|critical\n",
+            program, program, program);
 }
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        logInfo("usage: %s <COM port name> <log file name>\n", argv[0]);
+    startClock();
+    InitializeCriticalSection(&logLock);
+    const char** portSpecs = new const char*[argc];
+    int portCount = 0;
+    const char* brokerName = NULL;
+    const char* shmName = NULL;
+    const char* bondNames = NULL;
+    const char* traceFileName = NULL;
+    const char* captureFileName = NULL;
+    Replay* replay = NULL;
+    char* logOption = NULL;
+    LONG traceCapacity = 1 << 20;
+    DWORD priorityClass = 0;
+    char* positional[2] = {NULL, NULL};
+    int positionals = 0;
+    for (int a = 1; a < argc; ++a) {
+        const char* value;
+        if ((value = optionValue(argv[a], "--port")) != NULL) {
+            portSpecs[portCount++] = value;
+        } else if ((value = optionValue(argv[a], "--broker")) != NULL) {
+            brokerName = value;
+        } else if (strcmp(argv[a], "--broker") == 0) {
+            brokerName = "\\\\.\\pipe\\comProxy";
+        } else if ((value = optionValue(argv[a], "--backlog")) != NULL) {
+            int bytes = atoi(value);
+            if (bytes < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            backlogSize = bytes;
+        } else if ((value = optionValue(argv[a], "--shm")) != NULL) {
+            shmName = value;
+        } else if ((value = optionValue(argv[a], "--rx-reads")) != NULL) {
+            rxReadCount = atoi(value);
+            if (rxReadCount < 0) rxReadCount = 0;
+            if (rxReadCount == 1) rxReadCount = 2; // so one is always posted
+            if (rxReadCount > RX_READS_MAX) rxReadCount = RX_READS_MAX;
+        } else if ((value = optionValue(argv[a], "--tx-writes")) != NULL) {
+            txWriteCount = atoi(value);
+            if (txWriteCount < 1) txWriteCount = 1;
+            if (txWriteCount > TX_WRITES_MAX) txWriteCount = TX_WRITES_MAX;
+        } else if ((value = optionValue(argv[a], "--spin")) != NULL) {
+            spinMicroseconds = atoi(value);
+            const char* comma = strchr(value, ',');
+            if (comma != NULL) spinCpu = atoi(comma + 1);
+        } else if ((value = optionValue(argv[a], "--rx-gap")) != NULL) {
+            rxGapCharacters = atof(value); // converted to time per port, by rxGapTime
+            const char* comma = strchr(value, ',');
+            if (comma != NULL) rxBatchBytes = atoi(comma + 1);
+        } else if ((value = optionValue(argv[a], "--tx-coalesce")) != NULL) {
+            txCoalesceMicroseconds = atoi(value);
+            const char* comma = strchr(value, ',');
+            if (comma != NULL) {
+                txCoalesceBytes = atoi(comma + 1);
+                comma = strchr(comma + 1, ',');
+                if (comma != NULL) txDelimiter = strtol(comma + 1, NULL, 0) & 0xFF;
+            }
+        } else if ((value = optionValue(argv[a], "--rx-flow")) != NULL) {
+            if (strncmp(value, "rts", 3) == 0) {
+                rxFlowControl = RX_FLOW_RTS;
+            } else if (strncmp(value, "xon", 3) == 0) {
+                rxFlowControl = RX_FLOW_XON;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            const char* comma = strchr(value, ',');
+            if (comma != NULL) {
+                rxFlowHigh = atoi(comma + 1);
+                comma = strchr(comma + 1, ',');
+                if (comma != NULL) rxFlowLow = atoi(comma + 1);
+            }
+        } else if ((value = optionValue(argv[a], "--rx-buffer")) != NULL) {
+            rxBufferSize = atoi(value);
+            if (rxBufferSize < 16) rxBufferSize = 16;
+        } else if ((value = optionValue(argv[a], "--priority")) != NULL) {
+            static const struct {const char* name; DWORD priorityClass;} classes[] = {
+                {"idle", IDLE_PRIORITY_CLASS},
+                {"below", BELOW_NORMAL_PRIORITY_CLASS},
+                {"normal", NORMAL_PRIORITY_CLASS},
+                {"above", ABOVE_NORMAL_PRIORITY_CLASS},
+                {"high", HIGH_PRIORITY_CLASS},
+                {"realtime", REALTIME_PRIORITY_CLASS}};
+            int c = 0;
+            while (c < 6 && strcmp(classes[c].name, value) != 0) ++c;
+            if (c >= 6) {
+                usage(argv[0]);
+                return 1;
+            }
+            priorityClass = classes[c].priorityClass;
+        } else if ((value = optionValue(argv[a], "--engine-thread")) != NULL) {
+            if (!parseThreadOptions(value, &engineThreadOptions)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if ((value = optionValue(argv[a], "--stdin-thread")) != NULL) {
+            if (!parseThreadOptions(value, &stdinThreadOptions)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if ((value = optionValue(argv[a], "--stdout-thread")) != NULL) {
+            if (!parseThreadOptions(value, &stdoutThreadOptions)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--lock-memory") == 0) {
+            lockMemory = TRUE;
+        } else if ((value = optionValue(argv[a], "--trace")) != NULL) {
+            char* name = _strdup(value);
+            char* comma = strchr(name, ',');
+            if (comma != NULL) {
+                *comma = 0;
+                traceCapacity = atoi(comma + 1);
+                if (traceCapacity < 1) traceCapacity = 1;
+            }
+            traceFileName = name;
+        } else if ((value = optionValue(argv[a], "--log-level")) != NULL) {
+            int level = parseLogLevel(value);
+            if (level < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            logLevel = level;
+        } else if ((value = optionValue(argv[a], "--log")) != NULL) {
+            logOption = (char*) value;
+        } else if ((value = optionValue(argv[a], "--replay")) != NULL) {
+            char* name = _strdup(value);
+            char* comma = strchr(name, ',');
+            double speed = 1;
+            if (comma != NULL) {
+                *comma = 0;
+                speed = atof(comma + 1);
+                if (speed < 0) speed = 0;
+            }
+            replay = new Replay(name, speed);
+        } else if ((value = optionValue(argv[a], "--stats")) != NULL) {
+            statsSeconds = atoi(value);
+            const char* comma = strchr(value, ',');
+            if (comma != NULL) {
+                if (strcmp(comma + 1, "json") != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                statsJson = TRUE;
+            }
+        } else if ((value = optionValue(argv[a], "--capture")) != NULL) {
+            captureFileName = value;
+        } else if ((value = optionValue(argv[a], "--dump")) != NULL) {
+            if (strncmp(value, "hex", 3) == 0) {
+                dumpMode = DUMP_HEX;
+            } else if (value[0] == 'c' && (value[1] == 0 || value[1] == ',')) {
+                dumpMode = DUMP_C;
+            } else if (strncmp(value, "printable", 9) == 0) {
+                dumpMode = DUMP_PRINTABLE;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            const char* comma = strchr(value, ',');
+            if (comma != NULL) dumpMax = atoi(comma + 1);
+        } else if ((value = optionValue(argv[a], "--oob")) != NULL) {
+            oobEscape = strtol(value, NULL, 0) & 0xFF;
+        } else if ((value = optionValue(argv[a], "--bond")) != NULL) {
+            bondNames = value;
+        } else if ((value = optionValue(argv[a], "--threads")) != NULL) {
+            engineThreads = atoi(value);
+            if (engineThreads < 1) engineThreads = 1;
+        } else if (strncmp(argv[a], "--", 2) == 0 || positionals >= 2) {
+            usage(argv[0]);
+            return 1;
+        } else {
+            positional[positionals++] = argv[a];
+        }
+    }
+    BOOL multiPort = (portCount > 0 || brokerName != NULL);
+    // In multi-port and bonded mode, the only positional argument is the log file name.
+    char* logFileName = (multiPort || bondNames != NULL) ? positional[0] : positional[1];
+    if (bondNames != NULL
+        ? (multiPort || positionals > 1 || shmName != NULL || replay != NULL)
+        : multiPort ? (positionals > 1 || shmName != NULL || replay != NULL) : (positionals < 1)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (logOption != NULL) {
+        if (logFileName != NULL) {
+            usage(argv[0]);
+            return 1;
+        }
+        logFileName = logOption;
+    }
+    if (spinCpu >= 0 && engineThreadOptions.cpu >= 0) {
+        fprintf(stderr, "--spin and --engine-thread may not both set a CPU\n");
+        usage(argv[0]);
         return 1;
     }
-    if (argc > 2) {
-        logFile = fopen(argv[2], "w");
+    // The bond state isn't locked, so only one thread may change it.
+    if (bondNames != NULL) engineThreads = 1;
+    if (logFileName != NULL) {
+        logFile = fopen(logFileName, "w");
         if (logFile == NULL) {
-            fprintf(stderr, "fopen(%s) failed\n", argv[2]); 
+            fprintf(stderr, "fopen(%s) failed\n", logFileName); 
             return 2;
         }
+        logDirectory = _strdup(logFileName);
+        char* name = logDirectory;
+        for (char* c = logDirectory; *c != 0; ++c) {
+            if (*c == '\\' || *c == '/' || *c == ':') name = c + 1;
+        }
+        *name = 0;
     } else {
         logFile = stderr;
     }
+    startLogger();
+    if (!SetConsoleCtrlHandler(consoleControl, TRUE)) {
+        logLastError("SetConsoleCtrlHandler");
+    }
+    if (!multiPort) {
+        if (_setmode(stdinNumber, _O_BINARY) == -1) {
+            perror("_setmode(stdin, _O_BINARY");
+        }
+        if (_setmode(stdoutNumber, _O_BINARY) == -1) {
+            perror("_setmode(stdout, _O_BINARY");
+        }
+    }
+    if (priorityClass != 0 && !SetPriorityClass(GetCurrentProcess(), priorityClass)) {
+        logLastError("SetPriorityClass");
+    }
+    if (lockMemory && !SetProcessWorkingSetSize(GetCurrentProcess(), 8 << 20, 32 << 20)) {
+        // The default minimum working set is too small to lock much.
+        logLastError("SetProcessWorkingSetSize");
+    }
+    if (traceFileName != NULL) {
+        DWORD err = openTrace(traceFileName, traceCapacity);
+        if (err != ERROR_SUCCESS) {
+            logError("openTrace", err);
+            closeTrace();
+        }
+    }
+    if (captureFileName != NULL) {
+        DWORD err = openCapture(captureFileName);
+        if (err != ERROR_SUCCESS) {
+            logError("openCapture", err);
+            closeCapture();
+        }
+    }
+    DWORD err = completions.open(engineThreads);
+    if (err != ERROR_SUCCESS) {
+        logError("CreateIoCompletionPort", err);
+        return 8;
+    }
     int exitCode = 0;
-    if (_setmode(stdinNumber, _O_BINARY) == -1) {
-        perror("_setmode(stdin, _O_BINARY");
-    }
-    if (_setmode(stdoutNumber, _O_BINARY) == -1) {
-        perror("_setmode(stdout, _O_BINARY");
-    }
-    char* comPortName = argv[1];
-    logDebug("CreateFile(%s)", comPortName);
-    comHandle = CreateFile(comPortName,
-                           GENERIC_READ | GENERIC_WRITE,
-                           0, // not shared
-                           NULL, // no security
-                           OPEN_EXISTING,
-                           FILE_FLAG_OVERLAPPED,
-                           NULL); // template file
-    if (comHandle == INVALID_HANDLE_VALUE) {
-        DWORD err = GetLastError();
-        LPTSTR message = errorMessage(err);
-        logInfo("CreateFile(%s) error %d %s", comPortName, err, (message == NULL) ? "" : message);
-        if (message != NULL) LocalFree(message);
-        return 3;
+    Bond* bond = NULL;
+    if (bondNames != NULL) {
+        bond = newBond(bondNames);
+        // Open the links first, so the client can use them.
+        int openCode = 0;
+        int linksOpen = 0;
+        for (int l = 0; l < bond->linkCount; ++l) {
+            openCode = startPort(bond->links[l].port);
+            if (openCode == 0) ++linksOpen;
+        }
+        if (linksOpen <= 0) return openCode;
+        startPort(bond->client);
+    } else if (!multiPort) {
+        Port* port = new Port(positional[0], NULL, rxBufferSize);
+        port->shmName = shmName;
+        port->replay = replay;
+        int openCode = startPort(port);
+        if (openCode != 0) return openCode;
     }
-    setComm(comHandle);
-    comEventOverlapped.hEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
-    comRxOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    comTxOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-
-    HANDLE stdinReaderThread = CreateThread(NULL, 2048, stdinReader, NULL, 0, NULL);
-    HANDLE stdoutWriterThread = CreateThread(NULL, 2048, stdoutWriter, NULL, 0, NULL);
-
-    HANDLE waitables[] = {
-        comEventOverlapped.hEvent,
-        comRxOverlapped.hEvent,
-        comTxOverlapped.hEvent,
-        rxBuffer.notFull,
-        txBuffer.notEmpty,
-    };
-    while (TRUE) {
-        /*  This is unnecessary:
-        if (txBuffer.hasData() && comTxError == ERROR_SUCCESS) {
-            comTx();
-        }
-        ... because comTx() will be called when txBuffer.notEmpty is signaled.
-
-        This would frequently be a waste of time:
-        if (rxBuffer.hasSpace() && comRxError == ERROR_SUCCESS) {
-            comRx();
-        }
-        ... because it would only read zero bytes from the COM port.
-        The COM port indicates no input by returning ERROR_SUCCESS
-        and zero bytes read. To avoid this waste of time, we call
-        comRx() when WaitCommEvent returns EV_RXCHAR.
-        */
-        if ((stdoutDone || !rxBuffer.hasData())
-            && (comDone || (stdinDone && !txBuffer.hasData()))) {
-            break; // exit gracefully
-        }
-        DWORD waited = WaitForMultipleObjects(5, waitables, FALSE, 2000);
-        switch (waited) {
-        case WAIT_OBJECT_0 + 0: // COM event
-            comEvent();
-            continue;
-        case WAIT_OBJECT_0 + 3: // rxBuffer
-            if (comRxError != ERROR_SUCCESS) continue; // a Read operation is PENDING
-        case WAIT_OBJECT_0 + 1: // rx
-            comRx();
-            continue;
-        case WAIT_OBJECT_0 + 4: // txBuffer
-            if (comTxError != ERROR_SUCCESS) continue; // a Write operation is PENDING
-        case WAIT_OBJECT_0 + 2: // tx
-            comTx();
-            continue;
-        case WAIT_TIMEOUT:
-            logTrace("WAIT_TIMEOUT");
-            /* A Read may complete immediately with zero bytes read, and
-               a Write may complete immediately with zero bytes written.
-               Repeating the operation will complete immediately again.
-               WaitCommEvent might indicate when to retry, but NOT always.
-               So retry periodically:
-             */
-            if (rxBuffer.hasSpace() && comRxError == ERROR_SUCCESS) {
-                logTrace("comRx retry");
-                comRx();
-            }
-            if (txBuffer.hasData() && comTxError == ERROR_SUCCESS) {
-                logTrace("comTx retry");
-                comTx();
-            }
-            continue;
-        case WAIT_FAILED:
-            logLastError("WAIT_FAILED");
-            exitCode = 4;
-            break;
-        default:
-            logInfo("WaitForMultipleObjects %x", waited);
-            exitCode = 5;
-        }
-        break; // loop
-    }
-    if (exitCode == 0 && comDone) exitCode = 6;
-    logInfo("Exit code %d %s%stxData %d rxData %d",
-            exitCode,
-            (comDone ? "comDone " : ""),
-            (stdinDone ? "stdinDone " : ""),
-            txBuffer.hasData(),
-            rxBuffer.hasData());
-    CloseHandle(comHandle);
-    fclose(logFile);
+    for (int p = 0; p < portCount; ++p) {
+        int openCode = startPort(newPort(portSpecs[p]));
+        if (openCode != 0) exitCode = openCode;
+    }
+    if (brokerName != NULL) {
+        int brokerCode = brokerStart(brokerName);
+        if (brokerCode != 0) exitCode = brokerCode;
+    }
+    if (statsSeconds > 0) {
+        statsStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+        statsThread = CreateThread(NULL, 0, statsReporter, NULL, 0, NULL);
+        if (statsThread == NULL) logLastError("CreateThread(statsReporter)");
+    }
+    if (activePorts > 0) {
+        for (DWORD t = 1; t < engineThreads; ++t) {
+            CreateThread(NULL, 0, engine, NULL, 0, NULL);
+        }
+        if (spinCpu >= 0 && !SetThreadAffinityMask(GetCurrentThread(), ((DWORD_PTR) 1) << spinCpu)) {
+            logLastError("SetThreadAffinityMask");
+        }
+        int engineCode = engine(NULL);
+        if (engineCode != 0) exitCode = engineCode;
+    }
+    stopStats();
+    logLatencyHistogram("post to engine", latencyHistogram);
+    logLatencyHistogram("COM read to client", rxLatencyHistogram);
+    if (multiPort) {
+        if (exitCode == 0) exitCode = 6; // All the COM ports are done.
+        for (Port* port = ports; port != NULL; port = port->next) {
+            logInfo("%s %stxData %d rxData %d retries %d", port->comName,
+                    (port->comDone ? "comDone " : ""),
+                    port->txBuffer.hasData(),
+                    port->rxBuffer.hasData(),
+                    port->retries);
+            logComStats(port);
+            if (port->pipeHandle != INVALID_HANDLE_VALUE) CloseHandle(port->pipeHandle);
+            if (port->comHandle != INVALID_HANDLE_VALUE) CloseHandle(port->comHandle);
+        }
+        logInfo("Exit code %d", exitCode);
+    } else if (bond != NULL) {
+        Port* client = bond->client;
+        if (exitCode == 0 && client->comDone) exitCode = 6;
+        for (int l = 0; l < bond->linkCount; ++l) {
+            Port* link = bond->links[l].port;
+            logBondLink(&bond->links[l]);
+            logComStats(link);
+            if (link->comHandle != INVALID_HANDLE_VALUE) CloseHandle(link->comHandle);
+        }
+        logInfo("Exit code %d %s%stxData %d rxData %d lost %d",
+                exitCode,
+                (client->comDone ? "comDone " : ""),
+                (stdinDone ? "stdinDone " : ""),
+                client->txBuffer.hasData(),
+                client->rxBuffer.hasData(),
+                bond->lost);
+        logComStats(client);
+        client->rxBuffer.close();
+    } else {
+        Port* port = ports;
+        if (port->replay != NULL) replayStop(port->replay);
+        if (exitCode == 0 && port->comDone) exitCode = 6;
+        logInfo("Exit code %d %s%stxData %d rxData %d retries %d",
+                exitCode,
+                (port->comDone ? "comDone " : ""),
+                (stdinDone ? "stdinDone " : ""),
+                port->txBuffer.hasData(),
+                port->rxBuffer.hasData(),
+                port->retries);
+        logComStats(port);
+        port->rxBuffer.close();
+        if (port->comHandle != INVALID_HANDLE_VALUE) CloseHandle(port->comHandle);
+    }
+    closeTrace();
+    closeCapture();
+    closeLog();
     return exitCode;
 }
@@ -0,0 +1,236 @@
+/** Shared memory through which comProxy and the process that runs it can
+    exchange data, instead of through stdin and stdout. This is C, so the
+    parent process (or a native module of it) can include it.
+
+    The parent calls comProxyShmCreate and then runs comProxy --shm=<name>,
+    which calls comProxyShmOpen. The parent calls comProxyShmWrite to send
+    data to the COM port and comProxyShmRead to receive data from it.
+
+    Each direction of data flow is a ring buffer with one producer and one
+    consumer. Neither process needs a system call to add or remove data.
+    When a process must wait (because a ring is empty or full) it sets a
+    flag in the ring, and the other process rings an event (a doorbell)
+    after it changes the ring.
+*/
+#ifndef COM_PROXY_SHM_H
+#define COM_PROXY_SHM_H
+#include <Windows.h>
+#include <stdio.h>
+#include <string.h>
+
+#define COM_PROXY_SHM_MAGIC 0x4D485343 /* "CSHM" */
+#define COM_PROXY_SHM_VERSION 1
+#define COM_PROXY_SHM_MAX_NAME 200
+
+/** One direction of data flow. The data are in a buffer of size bytes;
+    dataIndex and spaceIndex are offsets into it. The ring is empty when
+    they're equal, and holds at most size - 1 bytes. Only the consumer
+    changes dataIndex, and only the producer changes spaceIndex.
+    The producer and consumer fields are in separate cache lines.
+*/
+typedef struct {
+    volatile LONG dataIndex; /* the first data byte */
+    volatile LONG consumerWaiting; /* ring dataBell after adding data */
+    LONG consumerPadding[14];
+    volatile LONG spaceIndex; /* the first empty byte */
+    volatile LONG producerWaiting; /* ring spaceBell after removing data */
+    volatile LONG closed; /* the producer won't add more data */
+    LONG producerPadding[13];
+} ComProxyShmRing;
+
+/** The layout of the shared memory. */
+typedef struct {
+    LONG magic;
+    LONG version;
+    LONG size; /* of each ring's buffer */
+    LONG padding[13];
+    ComProxyShmRing toCom; /* the parent produces and comProxy consumes */
+    ComProxyShmRing fromCom; /* comProxy produces and the parent consumes */
+    /* followed by the toCom buffer and then the fromCom buffer */
+} ComProxyShm;
+
+/** A process's view of the shared memory. */
+typedef struct {
+    HANDLE mapping;
+    ComProxyShm* shm;
+    BYTE* toComBuffer;
+    BYTE* fromComBuffer;
+    HANDLE toComData; /* rung after adding data to toCom */
+    HANDLE toComSpace; /* rung after removing data from toCom */
+    HANDLE fromComData; /* rung after adding data to fromCom */
+    HANDLE fromComSpace; /* rung after removing data from fromCom */
+} ComProxyShmView;
+
+/** Return the number of bytes that can be removed from ring, contiguously. */
+static __inline LONG comProxyShmHasData(const ComProxyShmRing* ring, LONG size) {
+    LONG data = ring->dataIndex;
+    LONG space = ring->spaceIndex;
+    return (space >= data) ? (space - data) : (size - data);
+}
+
+/** Return the number of bytes that can be added to ring, contiguously. */
+static __inline LONG comProxyShmHasSpace(const ComProxyShmRing* ring, LONG size) {
+    LONG data = ring->dataIndex;
+    LONG space = ring->spaceIndex;
+    return (space >= data)
+        ? (size - space - (data == 0 ? 1 : 0))
+        : (data - space - 1);
+}
+
+static __inline HANDLE comProxyShmEvent(const char* name, const char* suffix, BOOL create) {
+    char eventName[COM_PROXY_SHM_MAX_NAME + 20];
+    _snprintf(eventName, sizeof(eventName), "%s-%s", name, suffix);
+    eventName[sizeof(eventName) - 1] = 0;
+    return create
+        ? CreateEvent(NULL, FALSE, FALSE, eventName) /* auto-reset */
+        : OpenEvent(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, eventName);
+}
+
+static __inline void comProxyShmClose(ComProxyShmView* view) {
+    if (view->shm != NULL) UnmapViewOfFile(view->shm);
+    if (view->mapping != NULL) CloseHandle(view->mapping);
+    if (view->toComData != NULL) CloseHandle(view->toComData);
+    if (view->toComSpace != NULL) CloseHandle(view->toComSpace);
+    if (view->fromComData != NULL) CloseHandle(view->fromComData);
+    if (view->fromComSpace != NULL) CloseHandle(view->fromComSpace);
+    memset(view, 0, sizeof(*view));
+}
+
+/** Map the view, and open or create the events.
+    If size > 0, initialize the shared memory with rings of that size.
+*/
+static __inline DWORD comProxyShmMap(ComProxyShmView* view, const char* name, LONG size) {
+    BOOL create = (size > 0);
+    view->shm = (ComProxyShm*) MapViewOfFile(view->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (view->shm == NULL) return GetLastError();
+    if (create) {
+        memset(view->shm, 0, sizeof(ComProxyShm));
+        view->shm->size = size;
+        view->shm->version = COM_PROXY_SHM_VERSION;
+        MemoryBarrier();
+        view->shm->magic = COM_PROXY_SHM_MAGIC;
+    } else if (view->shm->magic != COM_PROXY_SHM_MAGIC
+               || view->shm->version != COM_PROXY_SHM_VERSION) {
+        return ERROR_INVALID_DATA;
+    }
+    view->toComBuffer = ((BYTE*) view->shm) + sizeof(ComProxyShm);
+    view->fromComBuffer = view->toComBuffer + view->shm->size;
+    view->toComData = comProxyShmEvent(name, "toComData", create);
+    view->toComSpace = comProxyShmEvent(name, "toComSpace", create);
+    view->fromComData = comProxyShmEvent(name, "fromComData", create);
+    view->fromComSpace = comProxyShmEvent(name, "fromComSpace", create);
+    if (view->toComData == NULL || view->toComSpace == NULL
+        || view->fromComData == NULL || view->fromComSpace == NULL) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+}
+
+/** Create the shared memory, with rings that hold up to size - 1 bytes.
+    The parent should call this before running comProxy.
+    Return an error code; ERROR_SUCCESS indicates success.
+*/
+static __inline DWORD comProxyShmCreate(ComProxyShmView* view, const char* name, LONG size) {
+    DWORD err;
+    memset(view, 0, sizeof(*view));
+    if (size <= 1 || strlen(name) > COM_PROXY_SHM_MAX_NAME) return ERROR_INVALID_PARAMETER;
+    view->mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+                                      sizeof(ComProxyShm) + 2 * size, name);
+    if (view->mapping == NULL) return GetLastError();
+    err = comProxyShmMap(view, name, size);
+    if (err != ERROR_SUCCESS) comProxyShmClose(view);
+    return err;
+}
+
+/** Open shared memory that was created by comProxyShmCreate.
+    Return an error code; ERROR_SUCCESS indicates success.
+*/
+static __inline DWORD comProxyShmOpen(ComProxyShmView* view, const char* name) {
+    DWORD err;
+    memset(view, 0, sizeof(*view));
+    if (strlen(name) > COM_PROXY_SHM_MAX_NAME) return ERROR_INVALID_PARAMETER;
+    view->mapping = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (view->mapping == NULL) return GetLastError();
+    err = comProxyShmMap(view, name, 0);
+    if (err != ERROR_SUCCESS) comProxyShmClose(view);
+    return err;
+}
+
+/** Copy up to length bytes into the toCom ring. If there's no space,
+    wait up to timeout milliseconds for some. Return the number of bytes
+    copied, which is zero if the wait timed out.
+*/
+static __inline LONG comProxyShmWrite(ComProxyShmView* view, const void* data, LONG length,
+                                      DWORD timeout) {
+    ComProxyShmRing* ring = &view->shm->toCom;
+    LONG size = view->shm->size;
+    LONG written = 0;
+    while (written < length) {
+        LONG space = comProxyShmHasSpace(ring, size);
+        if (space <= 0) {
+            if (written > 0) break;
+            InterlockedExchange(&ring->producerWaiting, 1);
+            if (comProxyShmHasSpace(ring, size) > 0) continue;
+            if (WaitForSingleObject(view->toComSpace, timeout) != WAIT_OBJECT_0) break;
+            continue;
+        }
+        if (space > length - written) space = length - written;
+        LONG spaceIndex = ring->spaceIndex;
+        memcpy(view->toComBuffer + spaceIndex, ((const BYTE*) data) + written, space);
+        spaceIndex += space;
+        if (spaceIndex == size) spaceIndex = 0;
+        InterlockedExchange(&ring->spaceIndex, spaceIndex);
+        written += space;
+    }
+    if (written > 0 && InterlockedExchange(&ring->consumerWaiting, 0)) {
+        SetEvent(view->toComData);
+    }
+    return written;
+}
+
+/** Tell comProxy there's no more data for the COM port (like closing its stdin). */
+static __inline void comProxyShmCloseWrite(ComProxyShmView* view) {
+    InterlockedExchange(&view->shm->toCom.closed, 1);
+    SetEvent(view->toComData);
+}
+
+/** Copy up to length bytes from the fromCom ring. If there's no data,
+    wait up to timeout milliseconds for some. Return the number of bytes
+    copied, which is zero if the wait timed out or comProxyShmEof.
+*/
+static __inline LONG comProxyShmRead(ComProxyShmView* view, void* buffer, LONG length,
+                                     DWORD timeout) {
+    ComProxyShmRing* ring = &view->shm->fromCom;
+    LONG size = view->shm->size;
+    LONG read = 0;
+    while (read < length) {
+        LONG data = comProxyShmHasData(ring, size);
+        if (data <= 0) {
+            if (read > 0 || ring->closed) break;
+            InterlockedExchange(&ring->consumerWaiting, 1);
+            if (comProxyShmHasData(ring, size) > 0 || ring->closed) continue;
+            if (WaitForSingleObject(view->fromComData, timeout) != WAIT_OBJECT_0) break;
+            continue;
+        }
+        if (data > length - read) data = length - read;
+        LONG dataIndex = ring->dataIndex;
+        MemoryBarrier(); /* Read the data after reading spaceIndex. */
+        memcpy(((BYTE*) buffer) + read, view->fromComBuffer + dataIndex, data);
+        dataIndex += data;
+        if (dataIndex == size) dataIndex = 0;
+        InterlockedExchange(&ring->dataIndex, dataIndex);
+        read += data;
+    }
+    if (read > 0 && InterlockedExchange(&ring->producerWaiting, 0)) {
+        SetEvent(view->fromComSpace);
+    }
+    return read;
+}
+
+/** Return TRUE if comProxy won't send any more data. */
+static __inline BOOL comProxyShmEof(ComProxyShmView* view) {
+    ComProxyShmRing* ring = &view->shm->fromCom;
+    return ring->closed && comProxyShmHasData(ring, view->shm->size) <= 0;
+}
+
+#endif /* COM_PROXY_SHM_H */
@@ -0,0 +1,70 @@
+/** The binary trace that comProxy --trace=<file> writes, and that
+    comProxyTraceDecode reads. This is C, so other tools can include it.
+
+    The file is a ComProxyTraceHeader followed by an array of capacity
+    ComProxyTraceRecords, which is used as a ring: when it's full, new
+    records replace the oldest ones. comProxy writes records through a
+    memory mapping, so tracing every I/O operation costs much less than
+    logging it as text.
+*/
+#ifndef COM_PROXY_TRACE_H
+#define COM_PROXY_TRACE_H
+#include <Windows.h>
+
+#define COM_PROXY_TRACE_MAGIC 0x43525443 /* "CTRC" */
+#define COM_PROXY_TRACE_VERSION 2 /* 2: next is a DWORD */
+#define COM_PROXY_TRACE_MAX_PORTS 32
+#define COM_PROXY_TRACE_MAX_NAME 32
+
+/* Event ids, and the meaning of a, b and c in their records: */
+#define COM_PROXY_TRACE_RX_START    1 /* ReadFile: a = bytes requested */
+#define COM_PROXY_TRACE_RX_DONE     2 /* a = error, b = bytes read, c = bytes in rxBuffer */
+#define COM_PROXY_TRACE_TX_START    3 /* WriteFile: a = bytes to write */
+#define COM_PROXY_TRACE_TX_DONE     4 /* a = error, b = bytes written, c = bytes in txBuffer */
+#define COM_PROXY_TRACE_COM_EVENT   5 /* WaitCommEvent: a = error, b = event mask */
+#define COM_PROXY_TRACE_COM_STATUS  6 /* ClearCommError: a = errors, b = cbInQue, c = cbOutQue */
+#define COM_PROXY_TRACE_CLIENT_TX   7 /* data from the client: c = bytes in txBuffer */
+#define COM_PROXY_TRACE_CLIENT_RX   8 /* data taken by the client: c = bytes in rxBuffer */
+#define COM_PROXY_TRACE_RETRY       9 /* a = retry delay (microseconds) */
+#define COM_PROXY_TRACE_FAILED     10 /* the COM port failed: a = error */
+
+typedef struct {
+    LONGLONG time; /* microseconds, from a monotonic clock */
+    DWORD sequence; /* position in the trace + 1; zero indicates an unused record */
+    WORD event; /* COM_PROXY_TRACE_* */
+    WORD port; /* index in ComProxyTraceHeader.portNames */
+    DWORD a;
+    DWORD b;
+    DWORD c;
+    DWORD reserved;
+} ComProxyTraceRecord;
+
+typedef struct {
+    LONG magic;
+    LONG version;
+    LONG recordSize; /* sizeof(ComProxyTraceRecord) */
+    LONG capacity; /* the number of records following the header */
+    volatile DWORD next; /* the position of the next record, modulo 2^32; records[next % capacity] */
+    LONG portCount;
+    LONGLONG startTime; /* ComProxyTraceRecord.time when the trace started */
+    FILETIME startWallTime; /* the time of day at startTime (UTC) */
+    char portNames[COM_PROXY_TRACE_MAX_PORTS][COM_PROXY_TRACE_MAX_NAME];
+} ComProxyTraceHeader;
+
+static __inline const char* comProxyTraceEventName(WORD event) {
+    switch (event) {
+    case COM_PROXY_TRACE_RX_START: return "rxStart";
+    case COM_PROXY_TRACE_RX_DONE: return "rxDone";
+    case COM_PROXY_TRACE_TX_START: return "txStart";
+    case COM_PROXY_TRACE_TX_DONE: return "txDone";
+    case COM_PROXY_TRACE_COM_EVENT: return "comEvent";
+    case COM_PROXY_TRACE_COM_STATUS: return "comStatus";
+    case COM_PROXY_TRACE_CLIENT_TX: return "clientTx";
+    case COM_PROXY_TRACE_CLIENT_RX: return "clientRx";
+    case COM_PROXY_TRACE_RETRY: return "retry";
+    case COM_PROXY_TRACE_FAILED: return "failed";
+    default: return "unknown";
+    }
+}
+
+#endif /* COM_PROXY_TRACE_H */
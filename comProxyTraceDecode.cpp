@@ -0,0 +1,134 @@
+/** Print a trace written by comProxy --trace=<file>, as text or CSV.
+    The records are printed in the order they were written. The trace may be
+    decoded while comProxy is still writing it; records that are being
+    written at that moment might be omitted.
+*/
+#include <Windows.h>
+#include <stdio.h>
+#include "comProxyTrace.h"
+
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [--csv] <trace file name>\n", program);
+}
+
+/** Describe the event's data, for people. */
+static void describe(const ComProxyTraceRecord* record, char* result, int size) {
+    unsigned long a = record->a, b = record->b, c = record->c;
+    switch (record->event) {
+    case COM_PROXY_TRACE_RX_START:
+    case COM_PROXY_TRACE_TX_START:
+        snprintf(result, size, "%lu bytes", a);
+        break;
+    case COM_PROXY_TRACE_RX_DONE:
+        snprintf(result, size, "error %lu read %lu rxBuffer %lu", a, b, c);
+        break;
+    case COM_PROXY_TRACE_TX_DONE:
+        snprintf(result, size, "error %lu wrote %lu txBuffer %lu", a, b, c);
+        break;
+    case COM_PROXY_TRACE_COM_EVENT:
+        snprintf(result, size, "error %lu mask %04lX", a, b);
+        break;
+    case COM_PROXY_TRACE_COM_STATUS:
+        snprintf(result, size, "errors %02lX inQueue %lu outQueue %lu", a, b, c);
+        break;
+    case COM_PROXY_TRACE_CLIENT_TX:
+        snprintf(result, size, "txBuffer %lu", c);
+        break;
+    case COM_PROXY_TRACE_CLIENT_RX:
+        snprintf(result, size, "rxBuffer %lu", c);
+        break;
+    case COM_PROXY_TRACE_RETRY:
+        snprintf(result, size, "after %lu usec", a);
+        break;
+    case COM_PROXY_TRACE_FAILED:
+        snprintf(result, size, "error %lu", a);
+        break;
+    default:
+        snprintf(result, size, "a %lu b %lu c %lu", a, b, c);
+    }
+}
+
+/** Format the time of day (UTC) when the event occurred. */
+static void timeOfDay(const ComProxyTraceHeader* header, LONGLONG time, char* result, int size) {
+    ULARGE_INTEGER start;
+    start.LowPart = header->startWallTime.dwLowDateTime;
+    start.HighPart = header->startWallTime.dwHighDateTime;
+    LONGLONG sinceStart = time - header->startTime; // microseconds
+    ULARGE_INTEGER at;
+    at.QuadPart = start.QuadPart + sinceStart * 10; // FILETIME counts 100 nanoseconds
+    FILETIME fileTime;
+    fileTime.dwLowDateTime = at.LowPart;
+    fileTime.dwHighDateTime = at.HighPart;
+    SYSTEMTIME st;
+    FileTimeToSystemTime(&fileTime, &st);
+    snprintf(result, size, "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ",
+             st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
+             (int) ((at.QuadPart / 10) % 1000000));
+}
+
+int main(int argc, char** argv) {
+    BOOL csv = FALSE;
+    const char* fileName = NULL;
+    for (int a = 1; a < argc; ++a) {
+        if (strcmp(argv[a], "--csv") == 0) {
+            csv = TRUE;
+        } else if (strncmp(argv[a], "--", 2) == 0 || fileName != NULL) {
+            usage(argv[0]);
+            return 1;
+        } else {
+            fileName = argv[a];
+        }
+    }
+    if (fileName == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        perror(fileName);
+        return 2;
+    }
+    ComProxyTraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || header.magic != COM_PROXY_TRACE_MAGIC
+        || header.version != COM_PROXY_TRACE_VERSION
+        || header.recordSize != sizeof(ComProxyTraceRecord)
+        || header.capacity <= 0) {
+        fprintf(stderr, "%s isn't a comProxy trace\n", fileName);
+        return 3;
+    }
+    ComProxyTraceRecord* records = new ComProxyTraceRecord[header.capacity];
+    LONG count = fread(records, sizeof(ComProxyTraceRecord), header.capacity, file);
+    fclose(file);
+    // Positions wrap around at 2^32, so visit the last capacity of them
+    // (oldest first) and skip the records whose sequence doesn't match.
+    DWORD capacity = (DWORD) header.capacity;
+    DWORD first = header.next - capacity;
+    if (csv) {
+        printf("sequence,time,microseconds,port,event,a,b,c\n");
+    }
+    for (DWORD k = 0; k < capacity; ++k) {
+        DWORD position = first + k;
+        DWORD r = position % capacity;
+        if (r >= (DWORD) count) continue;
+        ComProxyTraceRecord* record = &records[r];
+        if (record->sequence == 0 || record->sequence != position + 1) continue; // unused, overwritten or incomplete
+        const char* portName = (record->port < header.portCount && record->port < COM_PROXY_TRACE_MAX_PORTS)
+            ? header.portNames[record->port] : "?";
+        char time[64];
+        timeOfDay(&header, record->time, time, sizeof(time));
+        LONGLONG sinceStart = record->time - header.startTime;
+        if (csv) {
+            printf("%lu,%s,%lld,%s,%s,%lu,%lu,%lu\n",
+                   (unsigned long) record->sequence, time, (long long) sinceStart, portName,
+                   comProxyTraceEventName(record->event),
+                   (unsigned long) record->a, (unsigned long) record->b, (unsigned long) record->c);
+        } else {
+            char description[100];
+            describe(record, description, sizeof(description));
+            printf("%s %12.6f %s %-9s %s\n", time, sinceStart / 1000000.0, portName,
+                   comProxyTraceEventName(record->event), description);
+        }
+    }
+    return 0;
+}
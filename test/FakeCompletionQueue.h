@@ -0,0 +1,64 @@
+/** A CompletionQueue without a completion port, for tests (see comProxy.cpp).
+    post queues completions in memory, and next returns them in order,
+    without waiting: if none is queued, it times out at once. Handles can't
+    be associated with it, so COM ports and pipes can't be opened.
+*/
+class CompletionQueue {
+private:
+    struct Packet {
+        Operation* op; // NULL indicates stop
+        DWORD count;
+    };
+    static const int CAPACITY = 64;
+    Packet packets[CAPACITY];
+    int first = 0;
+    int length = 0;
+    CRITICAL_SECTION lock;
+
+    DWORD add(Operation* op, DWORD count) {
+        EnterCriticalSection(&lock);
+        BOOL full = (length >= CAPACITY);
+        if (!full) {
+            packets[(first + length) % CAPACITY].op = op;
+            packets[(first + length) % CAPACITY].count = count;
+            ++length;
+        }
+        LeaveCriticalSection(&lock);
+        return full ? ERROR_NOT_ENOUGH_MEMORY : ERROR_SUCCESS;
+    }
+public:
+    DWORD open(DWORD threads) {
+        InitializeCriticalSection(&lock);
+        return ERROR_SUCCESS;
+    }
+    DWORD associate(HANDLE file, Port* port) {
+        return ERROR_INVALID_HANDLE;
+    }
+    DWORD post(Operation* op, DWORD count) {
+        return add(op, count);
+    }
+    void stop(DWORD threads) {
+        for (DWORD t = 0; t < threads; ++t) add(NULL, 0);
+    }
+    DWORD next(Operation** op, DWORD* count, DWORD timeout) {
+        EnterCriticalSection(&lock);
+        BOOL empty = (length <= 0);
+        *op = NULL;
+        *count = 0;
+        if (!empty) {
+            *op = packets[first].op;
+            *count = packets[first].count;
+            first = (first + 1) % CAPACITY;
+            --length;
+        }
+        LeaveCriticalSection(&lock);
+        return empty ? WAIT_TIMEOUT : ERROR_SUCCESS;
+    }
+    /** Return the number of completions that next would return. */
+    int queued() {
+        EnterCriticalSection(&lock);
+        int result = length;
+        LeaveCriticalSection(&lock);
+        return result;
+    }
+};
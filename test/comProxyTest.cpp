@@ -0,0 +1,207 @@
+/** Tests of comProxy's engine that don't need a COM port: Operations posted
+    through a CompletionQueue (FakeCompletionQueue.h, which has no completion
+    port) and handled by engineStep, and the retry schedule. `build.sh test`
+    builds and runs them, on Windows or (with the stand-ins in linux/) on
+    Linux; the exit code is the number of failed checks.
+*/
+#define COM_PROXY_COMPLETION_QUEUE "test/FakeCompletionQueue.h"
+#define main comProxyMain
+#include "../comProxy.cpp"
+#undef main
+
+static int failures = 0;
+
+static void check(BOOL ok, const char* what) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    if (!ok) ++failures;
+}
+
+static Port* expectedPort = NULL;
+static int completed = 0;
+
+static void countCompletion(Port* port, DWORD err, DWORD count) {
+    check(port == expectedPort, "the completion is for the operation's port");
+    check(err == ERROR_SUCCESS && count == 0, "a posted operation completes with no error and no data");
+    ++completed;
+}
+
+static LONG latencies(LONG volatile* histogram) {
+    LONG total = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; ++b) total += histogram[b];
+    return total;
+}
+
+/** postOperation queues an Operation once until the engine completes it, and again after that. */
+static void testPostOnce() {
+    Port port("test", NULL);
+    expectedPort = &port;
+    Operation op = {0};
+    startOperation(&op, &port, countCompletion);
+    LONG latenciesBefore = latencies(latencyHistogram);
+    postOperation(&op);
+    postOperation(&op);
+    postOperation(&op);
+    check(op.posted && op.postedAt != 0, "postOperation marks the operation posted");
+    check(completions.queued() == 1, "posting it again before it completed queued nothing");
+    check(engineStep() < 0 && completed == 1, "the engine completes it once");
+    check(!op.posted && !op.pending && op.postedAt == 0, "and clears posted, pending and postedAt");
+    check(latencies(latencyHistogram) == latenciesBefore + 1, "and records its latency");
+    postOperation(&op);
+    check(completions.queued() == 1, "after it completed, it's posted again");
+    check(engineStep() < 0 && completed == 2, "and completed again");
+    check(engineStep() < 0 && completed == 2, "with nothing queued, the engine times out");
+    expectedPort = NULL;
+}
+
+/** retry doubles the delay up to RETRY_MAX, and resetRetry starts over. */
+static void testRetrySchedule() {
+    Port port("test", NULL);
+    port.comDone = TRUE; // so retry doesn't start COM operations
+    ports = &port;
+    check(retryTimeout() >= (DWORD) (RETRY_MAX / 1000), "without a retry, the engine waits RETRY_MAX");
+    scheduleRetry(&port);
+    LONGLONG due = port.retryDue;
+    check(due != 0 && port.retryDelay == RETRY_MIN, "scheduleRetry waits RETRY_MIN");
+    DWORD timeout = retryTimeout();
+    check(timeout >= 1 && timeout <= (DWORD) ((RETRY_MIN + 999) / 1000),
+          "the engine's timeout is rounded up to a millisecond, not zero");
+    scheduleRetry(&port);
+    check(port.retryDue == due, "scheduling again doesn't postpone the retry");
+    port.retryDue = microseconds() - 1;
+    check(retryTimeout() == 0, "an overdue retry doesn't wait");
+    check(engineStep() < 0 && port.retryDue == 0 && port.counters.retryTimeouts == 1,
+          "the engine retries when it times out");
+    check(port.retryDelay == 2 * RETRY_MIN, "and the next retry waits twice as long");
+    LONGLONG delay = port.retryDelay;
+    BOOL doubled = TRUE;
+    for (int r = 0; r < 20; ++r) {
+        scheduleRetry(&port);
+        retry(&port);
+        delay = (2 * delay > RETRY_MAX) ? RETRY_MAX : 2 * delay;
+        if (port.retryDue != 0 || port.retryDelay != delay) doubled = FALSE;
+    }
+    check(doubled, "each retry doubles the delay");
+    check(port.retryDelay == RETRY_MAX, "the delay stops at RETRY_MAX");
+    port.rxRetried = TRUE;
+    resetRetry(&port, &port.rxRetried);
+    check(port.retryDelay == RETRY_MIN && port.retries == 1 && !port.rxRetried,
+          "transferring data resets the delay, and counts the retry");
+    ports = NULL;
+}
+
+/** The latency of each COM read is recorded when the client has taken all its data. */
+static void testRxLatency() {
+    Port port("test", NULL);
+    LONG before = latencies(rxLatencyHistogram);
+    rxArrived(&port, 5);
+    port.rxBuffer.addData(5);
+    port.rxBuffer.removeData(3);
+    rxTaken(&port, TRUE);
+    check(latencies(rxLatencyHistogram) == before && port.rxArrivalCount == 1,
+          "a read's latency isn't recorded while the client hasn't taken all its data");
+    port.rxBuffer.removeData(2);
+    rxTaken(&port, TRUE);
+    check(latencies(rxLatencyHistogram) == before + 1 && port.rxArrivalCount == 0,
+          "it's recorded when the client has");
+    rxArrived(&port, 4);
+    port.rxBuffer.addData(4);
+    port.rxBuffer.removeData(4);
+    rxTaken(&port, FALSE);
+    check(latencies(rxLatencyHistogram) == before + 1 && port.rxArrivalCount == 0,
+          "discarded data's latency isn't recorded");
+    for (int r = 0; r < RX_ARRIVALS + 4; ++r) {
+        rxArrived(&port, 1);
+        port.rxBuffer.addData(1);
+    }
+    check(port.rxArrivalCount == RX_ARRIVALS, "reads beyond RX_ARRIVALS extend the last one");
+    port.rxBuffer.removeData(RX_ARRIVALS + 4);
+    rxTaken(&port, TRUE);
+    check(latencies(rxLatencyHistogram) == before + 1 + RX_ARRIVALS && port.rxArrivalCount == 0,
+          "and are recorded with it");
+}
+
+/** The dump functions format every byte as their loops over single bytes do
+    (which with SSE2, as on x86-64, checks their SSE2 loops against them). */
+static void testDump() {
+    BYTE all[256];
+    for (int b = 0; b < 256; ++b) all[b] = (BYTE) b;
+    char printable[256];
+    dumpPrintable(printable, all, 256);
+    BOOL ok = TRUE;
+    for (int b = 0; b < 256; ++b) {
+        if (printable[b] != ((b >= ' ' && b < 0x7F) ? b : '.')) ok = FALSE;
+    }
+    check(ok, "dumpPrintable replaces unprintable bytes with '.'");
+    char hex[512];
+    dumpHex(hex, all, 256);
+    ok = TRUE;
+    for (int b = 0; b < 256; ++b) {
+        if (hex[2 * b] != hexDigits[b >> 4] || hex[2 * b + 1] != hexDigits[b & 0x0F]) ok = FALSE;
+    }
+    check(ok, "dumpHex writes two hex digits per byte");
+    ok = TRUE;
+    for (int b = 0; b < 256; ++b) {
+        int plain = b;
+        while (plain < 256 && plain >= ' ' && plain < 0x7F && plain != '\\' && plain != '"') ++plain;
+        if (dumpPlain(all + b, 256 - b) != (DWORD) (plain - b)) ok = FALSE;
+    }
+    check(ok, "dumpPlain stops at bytes that need an escape");
+}
+
+/** Return the number of events that flightWrite logs. */
+static int flightEvents() {
+    FILE* log = tmpfile();
+    logFile = log;
+    flightWrite("test");
+    logFile = stderr;
+    rewind(log);
+    int events = -1;
+    char line[200];
+    while (fgets(line, sizeof(line), log) != NULL) {
+        sscanf(line, "(end of flight recorder; %d events)", &events);
+    }
+    fclose(log);
+    return events;
+}
+
+/** The flight recorder keeps working when its position wraps around. */
+static void testFlightWrap() {
+    Port port("test", NULL);
+    memset(flightRing, 0, sizeof(flightRing));
+    flightNext = 0;
+    for (int e = 0; e < 10; ++e) trace(&port, COM_PROXY_TRACE_RETRY, e, 0, 0);
+    check(flightEvents() == 10, "the flight recorder logs the events so far");
+    flightNext = 0x7FFFFFF0;
+    for (int e = 0; e < 0x20; ++e) trace(&port, COM_PROXY_TRACE_RETRY, e, 0, 0);
+    check(flightEvents() == 0x20, "past 2^31 events, it logs the new ones");
+    flightNext = (LONG) 0xFFFFFFF0;
+    for (DWORD e = 0; e < FLIGHT_RING_SIZE; ++e) trace(&port, COM_PROXY_TRACE_RETRY, e, 0, 0);
+    // The record at position 0xFFFFFFFF has sequence 0, so it looks incomplete.
+    check(flightEvents() == (int) FLIGHT_RING_SIZE - 1, "past 2^32 events, it logs a full ring");
+}
+
+/** CompletionQueue.stop makes the engine return. */
+static void testStop() {
+    completions.stop(1);
+    check(engineStep() == 0, "the engine returns 0 when it's stopped");
+}
+
+int main(int argc, char** argv) {
+    startClock();
+    InitializeCriticalSection(&logLock);
+    logFile = stderr;
+    logLevel = INFO; // only problems
+    DWORD err = completions.open(1);
+    if (err != ERROR_SUCCESS) {
+        logError("CompletionQueue.open", err);
+        return 100;
+    }
+    testPostOnce();
+    testRetrySchedule();
+    testRxLatency();
+    testDump();
+    testFlightWrap();
+    testStop();
+    printf("%d failed\n", failures);
+    return failures;
+}
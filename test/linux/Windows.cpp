@@ -0,0 +1,189 @@
+/** Linux implementations of the Windows functions declared in Windows.h.
+    Only what the tests use works: the clock, critical sections, Interlocked
+    functions and events that nobody waits for. Everything else sets the
+    last error to ERROR_CALL_NOT_IMPLEMENTED and fails.
+*/
+#include <Windows.h>
+#include <sched.h>
+#include <time.h>
+
+static __thread DWORD lastError = ERROR_SUCCESS;
+
+DWORD GetLastError() { return lastError; }
+void SetLastError(DWORD err) { lastError = err; }
+
+#define FAIL(result) { lastError = ERROR_CALL_NOT_IMPLEMENTED; return result; }
+
+HANDLE CreateEvent(LPSECURITY_ATTRIBUTES, BOOL, BOOL, LPCSTR) { return (HANDLE) malloc(1); }
+HANDLE OpenEvent(DWORD, BOOL, LPCSTR) FAIL(NULL)
+BOOL SetEvent(HANDLE) { return TRUE; }
+BOOL ResetEvent(HANDLE) { return TRUE; }
+BOOL CloseHandle(HANDLE) { return TRUE; }
+DWORD WaitForSingleObject(HANDLE, DWORD) FAIL(WAIT_FAILED)
+DWORD WaitForMultipleObjects(DWORD, const HANDLE*, BOOL, DWORD) FAIL(WAIT_FAILED)
+
+void InitializeCriticalSection(CRITICAL_SECTION* section) {
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&section->mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+BOOL InitializeCriticalSectionAndSpinCount(CRITICAL_SECTION* section, DWORD) {
+    InitializeCriticalSection(section);
+    return TRUE;
+}
+void DeleteCriticalSection(CRITICAL_SECTION* section) { pthread_mutex_destroy(&section->mutex); }
+void EnterCriticalSection(CRITICAL_SECTION* section) { pthread_mutex_lock(&section->mutex); }
+BOOL TryEnterCriticalSection(CRITICAL_SECTION* section) { return pthread_mutex_trylock(&section->mutex) == 0; }
+void LeaveCriticalSection(CRITICAL_SECTION* section) { pthread_mutex_unlock(&section->mutex); }
+
+/** Return 100-nanosecond intervals since 1601, like a FILETIME. */
+static ULONGLONG fileTimeNow() {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec + 11644473600ULL) * 10000000ULL + now.tv_nsec / 100;
+}
+void GetSystemTimeAsFileTime(FILETIME* fileTime) {
+    ULONGLONG now = fileTimeNow();
+    fileTime->dwLowDateTime = (DWORD) now;
+    fileTime->dwHighDateTime = (DWORD) (now >> 32);
+}
+void GetSystemTimePreciseAsFileTime(FILETIME* fileTime) { GetSystemTimeAsFileTime(fileTime); }
+BOOL FileTimeToSystemTime(const FILETIME* fileTime, SYSTEMTIME* systemTime) {
+    ULONGLONG ticks = ((ULONGLONG) fileTime->dwHighDateTime << 32) | fileTime->dwLowDateTime;
+    time_t seconds = (time_t) (ticks / 10000000ULL - 11644473600ULL);
+    tm utc;
+    gmtime_r(&seconds, &utc);
+    systemTime->wYear = utc.tm_year + 1900;
+    systemTime->wMonth = utc.tm_mon + 1;
+    systemTime->wDayOfWeek = utc.tm_wday;
+    systemTime->wDay = utc.tm_mday;
+    systemTime->wHour = utc.tm_hour;
+    systemTime->wMinute = utc.tm_min;
+    systemTime->wSecond = utc.tm_sec;
+    systemTime->wMilliseconds = (ticks / 10000) % 1000;
+    return TRUE;
+}
+void GetSystemTime(SYSTEMTIME* systemTime) {
+    FILETIME fileTime;
+    GetSystemTimeAsFileTime(&fileTime);
+    FileTimeToSystemTime(&fileTime, systemTime);
+}
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* frequency) {
+    frequency->QuadPart = 1000000000;
+    return TRUE;
+}
+BOOL QueryPerformanceCounter(LARGE_INTEGER* counter) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counter->QuadPart = now.tv_sec * 1000000000LL + now.tv_nsec;
+    return TRUE;
+}
+ULONGLONG GetTickCount64() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+DWORD GetTickCount() { return (DWORD) GetTickCount64(); }
+
+DWORD FormatMessage(DWORD, const void*, DWORD, DWORD, LPSTR, DWORD, va_list*) FAIL(0)
+HANDLE LocalFree(HANDLE memory) {
+    free(memory);
+    return NULL;
+}
+
+BOOL GetCommState(HANDLE, DCB*) FAIL(FALSE)
+BOOL SetCommState(HANDLE, DCB*) FAIL(FALSE)
+BOOL SetCommTimeouts(HANDLE, COMMTIMEOUTS*) FAIL(FALSE)
+BOOL GetCommTimeouts(HANDLE, COMMTIMEOUTS*) FAIL(FALSE)
+BOOL SetCommMask(HANDLE, DWORD) FAIL(FALSE)
+BOOL WaitCommEvent(HANDLE, LPDWORD, LPOVERLAPPED) FAIL(FALSE)
+BOOL ClearCommError(HANDLE, LPDWORD, COMSTAT*) FAIL(FALSE)
+BOOL EscapeCommFunction(HANDLE, DWORD) FAIL(FALSE)
+BOOL TransmitCommChar(HANDLE, char) FAIL(FALSE)
+BOOL GetCommModemStatus(HANDLE, LPDWORD) FAIL(FALSE)
+BOOL PurgeComm(HANDLE, DWORD) FAIL(FALSE)
+BOOL SetupComm(HANDLE, DWORD, DWORD) FAIL(FALSE)
+BOOL ReadFile(HANDLE, LPVOID, DWORD, LPDWORD, LPOVERLAPPED) FAIL(FALSE)
+BOOL WriteFile(HANDLE, const void*, DWORD, LPDWORD, LPOVERLAPPED) FAIL(FALSE)
+BOOL GetOverlappedResult(HANDLE, LPOVERLAPPED, LPDWORD, BOOL) FAIL(FALSE)
+BOOL CancelIo(HANDLE) FAIL(FALSE)
+BOOL CancelIoEx(HANDLE, LPOVERLAPPED) FAIL(FALSE)
+BOOL FlushFileBuffers(HANDLE) FAIL(FALSE)
+HANDLE CreateFile(LPCSTR, DWORD, DWORD, LPSECURITY_ATTRIBUTES, DWORD, DWORD, HANDLE) FAIL(INVALID_HANDLE_VALUE)
+
+HANDLE CreateThread(LPSECURITY_ATTRIBUTES, SIZE_T, LPTHREAD_START_ROUTINE, LPVOID, DWORD, LPDWORD) FAIL(NULL)
+HANDLE GetCurrentThread() { return (HANDLE) -2; }
+HANDLE GetCurrentProcess() { return (HANDLE) -1; }
+DWORD GetCurrentThreadId() { return (DWORD) (uintptr_t) pthread_self(); }
+DWORD GetCurrentProcessId() { return (DWORD) getpid(); }
+BOOL SetThreadPriority(HANDLE, int) FAIL(FALSE)
+BOOL SetPriorityClass(HANDLE, DWORD) FAIL(FALSE)
+DWORD_PTR SetThreadAffinityMask(HANDLE, DWORD_PTR) FAIL(0)
+BOOL SetProcessWorkingSetSize(HANDLE, SIZE_T, SIZE_T) FAIL(FALSE)
+BOOL VirtualLock(LPVOID, SIZE_T) FAIL(FALSE)
+LPVOID VirtualAlloc(LPVOID, SIZE_T, DWORD, DWORD) FAIL(NULL)
+BOOL VirtualFree(LPVOID, SIZE_T, DWORD) FAIL(FALSE)
+void Sleep(DWORD milliseconds) { usleep(milliseconds * 1000); }
+DWORD SleepEx(DWORD milliseconds, BOOL) {
+    Sleep(milliseconds);
+    return 0;
+}
+BOOL SwitchToThread() { return sched_yield() == 0; }
+
+HANDLE CreateIoCompletionPort(HANDLE, HANDLE, ULONG_PTR, DWORD) FAIL(NULL)
+BOOL GetQueuedCompletionStatus(HANDLE, LPDWORD, PULONG_PTR, LPOVERLAPPED*, DWORD) FAIL(FALSE)
+BOOL GetQueuedCompletionStatusEx(HANDLE, LPOVERLAPPED_ENTRY, ULONG, ULONG*, DWORD, BOOL) FAIL(FALSE)
+BOOL PostQueuedCompletionStatus(HANDLE, DWORD, ULONG_PTR, LPOVERLAPPED) FAIL(FALSE)
+BOOL SetFileCompletionNotificationModes(HANDLE, BYTE) FAIL(FALSE)
+HANDLE CreateNamedPipe(LPCSTR, DWORD, DWORD, DWORD, DWORD, DWORD, DWORD, LPSECURITY_ATTRIBUTES) FAIL(INVALID_HANDLE_VALUE)
+BOOL ConnectNamedPipe(HANDLE, LPOVERLAPPED) FAIL(FALSE)
+BOOL DisconnectNamedPipe(HANDLE) FAIL(FALSE)
+BOOL PeekNamedPipe(HANDLE, LPVOID, DWORD, LPDWORD, LPDWORD, LPDWORD) FAIL(FALSE)
+HANDLE CreateFileMapping(HANDLE, LPSECURITY_ATTRIBUTES, DWORD, DWORD, DWORD, LPCSTR) FAIL(NULL)
+HANDLE OpenFileMapping(DWORD, BOOL, LPCSTR) FAIL(NULL)
+LPVOID MapViewOfFile(HANDLE, DWORD, DWORD, DWORD, SIZE_T) FAIL(NULL)
+BOOL UnmapViewOfFile(const void*) FAIL(FALSE)
+BOOL FlushViewOfFile(const void*, SIZE_T) FAIL(FALSE)
+BOOL SetFilePointerEx(HANDLE, LARGE_INTEGER, LARGE_INTEGER*, DWORD) FAIL(FALSE)
+BOOL SetEndOfFile(HANDLE) FAIL(FALSE)
+BOOL SetConsoleCtrlHandler(PHANDLER_ROUTINE, BOOL) FAIL(FALSE)
+HANDLE CreateWaitableTimer(LPSECURITY_ATTRIBUTES, BOOL, LPCSTR) FAIL(NULL)
+BOOL RegisterWaitForSingleObject(HANDLE*, HANDLE, void (WINAPI*)(void*, BOOL), void*, ULONG, ULONG) FAIL(FALSE)
+
+LONG InterlockedIncrement(LONG volatile* target) { return __sync_add_and_fetch(target, 1); }
+LONG InterlockedDecrement(LONG volatile* target) { return __sync_sub_and_fetch(target, 1); }
+LONG InterlockedExchange(LONG volatile* target, LONG value) { return __sync_lock_test_and_set(target, value); }
+LONG InterlockedCompareExchange(LONG volatile* target, LONG value, LONG comparand) {
+    return __sync_val_compare_and_swap(target, comparand, value);
+}
+LONG InterlockedExchangeAdd(LONG volatile* target, LONG value) { return __sync_fetch_and_add(target, value); }
+LONGLONG InterlockedIncrement64(LONGLONG volatile* target) { return __sync_add_and_fetch(target, 1); }
+LONGLONG InterlockedExchangeAdd64(LONGLONG volatile* target, LONGLONG value) {
+    return __sync_fetch_and_add(target, value);
+}
+LONGLONG InterlockedCompareExchange64(LONGLONG volatile* target, LONGLONG value, LONGLONG comparand) {
+    return __sync_val_compare_and_swap(target, comparand, value);
+}
+void* InterlockedCompareExchangePointer(void* volatile* target, void* value, void* comparand) {
+    return __sync_val_compare_and_swap(target, comparand, value);
+}
+void* InterlockedExchangePointer(void* volatile* target, void* value) {
+    return __sync_lock_test_and_set(target, value);
+}
+
+DWORD GetEnvironmentVariable(LPCSTR name, LPSTR value, DWORD size) {
+    const char* found = getenv(name);
+    if (found == NULL) FAIL(0)
+    DWORD length = (DWORD) strlen(found);
+    if (length >= size) return length + 1;
+    memcpy(value, found, length + 1);
+    return length;
+}
+int _fileno(FILE* file) { return fileno(file); }
+int _read(int fd, void* buffer, unsigned size) { return (int) read(fd, buffer, size); }
+int _write(int fd, const void* buffer, unsigned size) { return (int) write(fd, buffer, size); }
+int _setmode(int, int) { return 0; }
+intptr_t _get_osfhandle(int fd) { return fd; }
+char* _strdup(const char* s) { return strdup(s); }
@@ -0,0 +1,228 @@
+/** A stand-in for the parts of Windows.h that comProxy.cpp uses, so that
+    test/comProxyTest.cpp can be built and run on Linux (see build.sh).
+    Windows.cpp implements the clock, critical sections and Interlocked
+    functions; the rest fail with ERROR_CALL_NOT_IMPLEMENTED.
+*/
+#pragma once
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <strings.h>
+#include <unistd.h>
+typedef int BOOL; typedef unsigned char BYTE; typedef uint32_t DWORD; typedef void* HANDLE;
+typedef unsigned short WORD; typedef int32_t LONG; typedef uint32_t ULONG; typedef char* LPSTR; typedef char* LPTSTR;
+typedef const char* LPCSTR; typedef void* LPVOID; typedef DWORD* LPDWORD; typedef uintptr_t ULONG_PTR; typedef ULONG_PTR DWORD_PTR;
+typedef ULONG_PTR* PULONG_PTR; typedef int64_t LONGLONG; typedef uint64_t ULONGLONG; typedef uintptr_t SIZE_T; typedef int INT;
+typedef unsigned int UINT; typedef char CHAR;typedef unsigned long long DWORD64;
+typedef union { struct { DWORD LowPart; LONG HighPart; }; LONGLONG QuadPart; } LARGE_INTEGER;
+typedef union { struct { DWORD LowPart; DWORD HighPart; }; ULONGLONG QuadPart; } ULARGE_INTEGER;
+#define TRUE 1
+#define FALSE 0
+#define WINAPI
+#define INFINITE 0xFFFFFFFF
+#define MAXDWORD 0xffffffff
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+typedef struct { DWORD Internal, InternalHigh, Offset, OffsetHigh; HANDLE hEvent; } OVERLAPPED, *LPOVERLAPPED;
+typedef struct { ULONG_PTR lpCompletionKey; LPOVERLAPPED lpOverlapped; ULONG_PTR Internal; DWORD dwNumberOfBytesTransferred; } OVERLAPPED_ENTRY, *LPOVERLAPPED_ENTRY;
+typedef struct { WORD wYear, wMonth, wDayOfWeek, wDay, wHour, wMinute, wSecond, wMilliseconds; } SYSTEMTIME;
+typedef struct { DWORD dwLowDateTime, dwHighDateTime; } FILETIME;
+typedef struct { pthread_mutex_t mutex; } CRITICAL_SECTION;
+typedef struct { DWORD DCBlength, BaudRate; DWORD fBinary:1, fParity:1, fOutxCtsFlow:1, fOutxDsrFlow:1, fDtrControl:2, fDsrSensitivity:1, fTXContinueOnXoff:1, fOutX:1, fInX:1, fErrorChar:1, fNull:1, fRtsControl:2, fAbortOnError:1; WORD XonLim, XoffLim; BYTE ByteSize, Parity, StopBits; char XonChar, XoffChar, ErrorChar, EofChar, EvtChar; } DCB;
+typedef struct { DWORD ReadIntervalTimeout, ReadTotalTimeoutMultiplier, ReadTotalTimeoutConstant, WriteTotalTimeoutMultiplier, WriteTotalTimeoutConstant; } COMMTIMEOUTS;
+typedef struct { DWORD fCtsHold:1, fDsrHold:1, fRlsdHold:1, fXoffHold:1, fXoffSent:1, fEof:1, fTxim:1, fReserved:25; DWORD cbInQue, cbOutQue; } COMSTAT;
+typedef struct { DWORD nLength; void* lpSecurityDescriptor; BOOL bInheritHandle; } SECURITY_ATTRIBUTES, *LPSECURITY_ATTRIBUTES;
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID);
+typedef BOOL (WINAPI *PHANDLER_ROUTINE)(DWORD);
+enum { ERROR_SUCCESS=0, ERROR_FILE_NOT_FOUND=2, ERROR_ACCESS_DENIED=5, ERROR_INVALID_HANDLE=6, ERROR_NOT_ENOUGH_MEMORY=8, ERROR_WRITE_FAULT=29, ERROR_HANDLE_EOF=38, ERROR_BROKEN_PIPE=109, ERROR_INSUFFICIENT_BUFFER=122, ERROR_ALREADY_EXISTS=183, ERROR_NO_DATA=232, ERROR_PIPE_NOT_CONNECTED=233, ERROR_MORE_DATA=234, ERROR_OPERATION_ABORTED=995, ERROR_IO_INCOMPLETE=996, ERROR_IO_PENDING=997, ERROR_PIPE_CONNECTED=535, ERROR_PIPE_LISTENING=536, WAIT_TIMEOUT=258, ERROR_SEM_TIMEOUT=121, ERROR_CALL_NOT_IMPLEMENTED=120, ERROR_NOT_FOUND=1168, ERROR_ABANDONED_WAIT_0=735 };
+#define WAIT_OBJECT_0 0
+#define WAIT_FAILED 0xFFFFFFFF
+#define WAIT_ABANDONED_0 0x80
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define OPEN_EXISTING 3
+#define CREATE_ALWAYS 2
+#define OPEN_ALWAYS 4
+#define FILE_SHARE_READ 1
+#define FILE_SHARE_WRITE 2
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define FILE_FLAG_OVERLAPPED 0x40000000
+#define FILE_FLAG_FIRST_PIPE_INSTANCE 0x00080000
+#define PIPE_ACCESS_DUPLEX 3
+#define PIPE_ACCESS_INBOUND 1
+#define PIPE_TYPE_BYTE 0
+#define PIPE_READMODE_BYTE 0
+#define PIPE_WAIT 0
+#define PIPE_REJECT_REMOTE_CLIENTS 8
+#define PIPE_UNLIMITED_INSTANCES 255
+#define FORMAT_MESSAGE_ALLOCATE_BUFFER 0x100
+#define FORMAT_MESSAGE_FROM_SYSTEM 0x1000
+#define FORMAT_MESSAGE_IGNORE_INSERTS 0x200
+#define LANG_NEUTRAL 0
+#define SUBLANG_DEFAULT 1
+#define MAKELANGID(a,b) ((a)|((b)<<10))
+#define CBR_9600 9600
+#define NOPARITY 0
+#define ODDPARITY 1
+#define EVENPARITY 2
+#define MARKPARITY 3
+#define SPACEPARITY 4
+#define ONESTOPBIT 0
+#define ONE5STOPBITS 1
+#define TWOSTOPBITS 2
+#define DTR_CONTROL_ENABLE 1
+#define DTR_CONTROL_DISABLE 0
+#define RTS_CONTROL_ENABLE 1
+#define RTS_CONTROL_DISABLE 0
+#define RTS_CONTROL_HANDSHAKE 2
+#define EV_RXCHAR 1
+#define EV_RXFLAG 2
+#define EV_TXEMPTY 4
+#define EV_CTS 8
+#define EV_DSR 0x10
+#define EV_RLSD 0x20
+#define EV_BREAK 0x40
+#define EV_ERR 0x80
+#define EV_RING 0x100
+#define CE_RXOVER 1
+#define CE_OVERRUN 2
+#define CE_RXPARITY 4
+#define CE_FRAME 8
+#define CE_BREAK 0x10
+#define CE_TXFULL 0x100
+#define SETRTS 3
+#define CLRRTS 4
+#define SETDTR 5
+#define CLRDTR 6
+#define SETXOFF 1
+#define SETXON 2
+#define SETBREAK 8
+#define CLRBREAK 9
+#define PURGE_TXABORT 1
+#define PURGE_RXABORT 2
+#define PURGE_TXCLEAR 4
+#define PURGE_RXCLEAR 8
+#define MS_CTS_ON 0x10
+#define MS_DSR_ON 0x20
+#define MS_RING_ON 0x40
+#define MS_RLSD_ON 0x80
+#define PAGE_READWRITE 4
+#define FILE_MAP_ALL_ACCESS 0xF001F
+#define FILE_MAP_WRITE 2
+#define FILE_MAP_READ 4
+#define EVENT_MODIFY_STATE 2
+#define SYNCHRONIZE 0x100000
+#define THREAD_PRIORITY_NORMAL 0
+#define THREAD_PRIORITY_ABOVE_NORMAL 1
+#define THREAD_PRIORITY_HIGHEST 2
+#define THREAD_PRIORITY_TIME_CRITICAL 15
+#define THREAD_PRIORITY_BELOW_NORMAL -1
+#define THREAD_PRIORITY_LOWEST -2
+#define THREAD_PRIORITY_IDLE -15
+#define NORMAL_PRIORITY_CLASS 0x20
+#define ABOVE_NORMAL_PRIORITY_CLASS 0x8000
+#define HIGH_PRIORITY_CLASS 0x80
+#define REALTIME_PRIORITY_CLASS 0x100
+#define BELOW_NORMAL_PRIORITY_CLASS 0x4000
+#define IDLE_PRIORITY_CLASS 0x40
+#define CTRL_C_EVENT 0
+#define CTRL_BREAK_EVENT 1
+#define CREATE_SUSPENDED 4
+#define INFINITE_TIMEOUT 0
+#define STACK_SIZE_PARAM_IS_A_RESERVATION 0x10000
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_RELEASE 0x8000
+#define FILE_BEGIN 0
+#define FILE_CURRENT 1
+#define FILE_END 2
+#define PIPE_NOWAIT 1
+#define FILE_SKIP_COMPLETION_PORT_ON_SUCCESS 1
+#define FILE_SKIP_SET_EVENT_ON_HANDLE 2
+#define HasOverlappedIoCompleted(o) ((o)->Internal != 0x103)
+#define YieldProcessor() ((void)0)
+#define MemoryBarrier() __sync_synchronize()
+#define offsetof_(a,b) __builtin_offsetof(a,b)
+#define CONTAINING_RECORD(address, type, field) ((type *)((char*)(address) - __builtin_offsetof(type, field)))
+HANDLE CreateEvent(LPSECURITY_ATTRIBUTES, BOOL, BOOL, LPCSTR);
+HANDLE OpenEvent(DWORD, BOOL, LPCSTR);
+BOOL SetEvent(HANDLE); BOOL ResetEvent(HANDLE); BOOL CloseHandle(HANDLE);
+DWORD GetLastError(); void SetLastError(DWORD);
+DWORD WaitForSingleObject(HANDLE, DWORD);
+DWORD WaitForMultipleObjects(DWORD, const HANDLE*, BOOL, DWORD);
+void InitializeCriticalSection(CRITICAL_SECTION*); void DeleteCriticalSection(CRITICAL_SECTION*);
+void EnterCriticalSection(CRITICAL_SECTION*); void LeaveCriticalSection(CRITICAL_SECTION*);
+BOOL InitializeCriticalSectionAndSpinCount(CRITICAL_SECTION*, DWORD);
+void GetSystemTime(SYSTEMTIME*); void GetSystemTimeAsFileTime(FILETIME*); void GetSystemTimePreciseAsFileTime(FILETIME*);
+BOOL FileTimeToSystemTime(const FILETIME*, SYSTEMTIME*);
+BOOL QueryPerformanceCounter(LARGE_INTEGER*); BOOL QueryPerformanceFrequency(LARGE_INTEGER*);
+DWORD GetTickCount(); ULONGLONG GetTickCount64();
+DWORD FormatMessage(DWORD, const void*, DWORD, DWORD, LPSTR, DWORD, va_list*);
+HANDLE LocalFree(HANDLE);
+BOOL GetCommState(HANDLE, DCB*); BOOL SetCommState(HANDLE, DCB*);
+BOOL SetCommTimeouts(HANDLE, COMMTIMEOUTS*); BOOL GetCommTimeouts(HANDLE, COMMTIMEOUTS*); BOOL SetCommMask(HANDLE, DWORD);
+BOOL WaitCommEvent(HANDLE, LPDWORD, LPOVERLAPPED);
+BOOL ClearCommError(HANDLE, LPDWORD, COMSTAT*);
+BOOL EscapeCommFunction(HANDLE, DWORD);
+BOOL TransmitCommChar(HANDLE, char);
+BOOL GetCommModemStatus(HANDLE, LPDWORD);
+BOOL PurgeComm(HANDLE, DWORD);
+BOOL SetupComm(HANDLE, DWORD, DWORD);
+BOOL ReadFile(HANDLE, LPVOID, DWORD, LPDWORD, LPOVERLAPPED);
+BOOL WriteFile(HANDLE, const void*, DWORD, LPDWORD, LPOVERLAPPED);
+BOOL GetOverlappedResult(HANDLE, LPOVERLAPPED, LPDWORD, BOOL);
+BOOL CancelIo(HANDLE); BOOL CancelIoEx(HANDLE, LPOVERLAPPED);
+BOOL FlushFileBuffers(HANDLE);
+HANDLE CreateFile(LPCSTR, DWORD, DWORD, LPSECURITY_ATTRIBUTES, DWORD, DWORD, HANDLE);
+HANDLE CreateThread(LPSECURITY_ATTRIBUTES, SIZE_T, LPTHREAD_START_ROUTINE, LPVOID, DWORD, LPDWORD);
+HANDLE GetCurrentThread(); HANDLE GetCurrentProcess(); DWORD GetCurrentThreadId(); DWORD GetCurrentProcessId();
+BOOL SetThreadPriority(HANDLE, int); BOOL SetPriorityClass(HANDLE, DWORD);
+DWORD_PTR SetThreadAffinityMask(HANDLE, DWORD_PTR);
+BOOL SetProcessWorkingSetSize(HANDLE, SIZE_T, SIZE_T);
+BOOL VirtualLock(LPVOID, SIZE_T);
+LPVOID VirtualAlloc(LPVOID, SIZE_T, DWORD, DWORD); BOOL VirtualFree(LPVOID, SIZE_T, DWORD);
+void Sleep(DWORD); DWORD SleepEx(DWORD, BOOL); BOOL SwitchToThread();
+HANDLE CreateIoCompletionPort(HANDLE, HANDLE, ULONG_PTR, DWORD);
+BOOL GetQueuedCompletionStatus(HANDLE, LPDWORD, PULONG_PTR, LPOVERLAPPED*, DWORD);
+BOOL GetQueuedCompletionStatusEx(HANDLE, LPOVERLAPPED_ENTRY, ULONG, ULONG*, DWORD, BOOL);
+BOOL PostQueuedCompletionStatus(HANDLE, DWORD, ULONG_PTR, LPOVERLAPPED);
+BOOL SetFileCompletionNotificationModes(HANDLE, BYTE);
+HANDLE CreateNamedPipe(LPCSTR, DWORD, DWORD, DWORD, DWORD, DWORD, DWORD, LPSECURITY_ATTRIBUTES);
+BOOL ConnectNamedPipe(HANDLE, LPOVERLAPPED); BOOL DisconnectNamedPipe(HANDLE);
+BOOL PeekNamedPipe(HANDLE, LPVOID, DWORD, LPDWORD, LPDWORD, LPDWORD);
+HANDLE CreateFileMapping(HANDLE, LPSECURITY_ATTRIBUTES, DWORD, DWORD, DWORD, LPCSTR);
+HANDLE OpenFileMapping(DWORD, BOOL, LPCSTR);
+LPVOID MapViewOfFile(HANDLE, DWORD, DWORD, DWORD, SIZE_T); BOOL UnmapViewOfFile(const void*);
+BOOL FlushViewOfFile(const void*, SIZE_T);
+BOOL SetFilePointerEx(HANDLE, LARGE_INTEGER, LARGE_INTEGER*, DWORD); BOOL SetEndOfFile(HANDLE);
+BOOL SetConsoleCtrlHandler(PHANDLER_ROUTINE, BOOL);
+HANDLE CreateWaitableTimer(LPSECURITY_ATTRIBUTES, BOOL, LPCSTR);
+BOOL RegisterWaitForSingleObject(HANDLE*, HANDLE, void (WINAPI*)(void*, BOOL), void*, ULONG, ULONG);
+#define WT_EXECUTEDEFAULT 0
+#define WT_EXECUTEINWAITTHREAD 4
+LONG InterlockedIncrement(LONG volatile*); LONG InterlockedDecrement(LONG volatile*);
+LONG InterlockedExchange(LONG volatile*, LONG); LONG InterlockedCompareExchange(LONG volatile*, LONG, LONG);
+LONG InterlockedExchangeAdd(LONG volatile*, LONG);
+LONGLONG InterlockedIncrement64(LONGLONG volatile*); LONGLONG InterlockedExchangeAdd64(LONGLONG volatile*, LONGLONG);
+LONGLONG InterlockedCompareExchange64(LONGLONG volatile*, LONGLONG, LONGLONG);
+void* InterlockedCompareExchangePointer(void* volatile*, void*, void*);
+void* InterlockedExchangePointer(void* volatile*, void*);
+DWORD GetEnvironmentVariable(LPCSTR, LPSTR, DWORD);
+int _fileno(FILE*); int _read(int, void*, unsigned); int _write(int, const void*, unsigned); int _setmode(int, int);
+#define _O_BINARY 0x8000
+intptr_t _get_osfhandle(int);
+#define _aligned_malloc(s,a) aligned_alloc(a,s)
+#define _aligned_free free
+#define __declspec(x)
+#define _stricmp strcasecmp
+#define _strnicmp strncasecmp
+#define stricmp strcasecmp
+char* _strdup(const char*);
+#define _snprintf snprintf
+#define ERROR_INVALID_DATA 13
+#define ERROR_INVALID_PARAMETER 87
+#define MAX_PATH 260
+BOOL TryEnterCriticalSection(CRITICAL_SECTION*);